@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// Runs blankvm on the bench guests and prints one JSON object per result.
+// Every measurement is the best of several runs of the whole process.
+
+static const char *blankvm;
+static const char *guest_dir;
+static int runs = 5;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Runs blankvm once with the 32-bit input (if any) as its serial input, returns wall time in ns.
+static int64_t run_once(char **args, const uint32_t *input, int check_status) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    // fits into the pipe buffer, so it can be written before the guest starts
+    if (input && write(pipe_fds[1], input, sizeof(*input)) != sizeof(*input)) {
+        perror("write input");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    close(pipe_fds[1]);
+
+    const uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(pipe_fds[0]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(pipe_fds[0], STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(blankvm, args);
+        _exit(127);
+    }
+
+    close(pipe_fds[0]);
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        return -1;
+    }
+    const uint64_t end = now_ns();
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127 || (check_status && WEXITSTATUS(status) != 0)) {
+        fprintf(stderr, "blankvm failed:");
+        for (size_t i = 0; args[i]; ++i)
+            fprintf(stderr, " %s", args[i]);
+        fprintf(stderr, "\n");
+        return -1;
+    }
+
+    return end - start;
+}
+
+static int64_t run_best(const char *mode, const char *mem, const char *guest, const uint32_t *input,
+        int check_status) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.bin", guest_dir, guest);
+
+    char *args[] = { (char*)blankvm, (char*)mode, "-m", (char*)mem, path, NULL };
+
+    int64_t best = -1;
+    for (int i = 0; i < runs; ++i) {
+        int64_t t = run_once(args, input, check_status);
+        if (t < 0)
+            return -1;
+        if (best < 0 || t < best)
+            best = t;
+    }
+
+    return best;
+}
+
+static void report(const char *bench, const char *mode, const char *mem, double value, const char *unit) {
+    printf("{\"bench\": \"%s\", \"mode\": \"%s\", \"mem\": \"%s\", \"value\": %.3f, \"unit\": \"%s\"}\n",
+        bench, mode, mem, value, unit);
+    fflush(stdout);
+}
+
+// Process start to the guest's first instruction (which immediately stops it).
+static int bench_boot(void) {
+    static const struct {
+        const char *mode;
+        const char *guest;
+    } modes[] = { { "-R", "boot16" }, { "-P", "boot32" }, { "-L", "boot64" } };
+    static const char *sizes[] = { "1M", "16M", "256M", "4G", "64G" };
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(*modes); ++i) {
+        for (size_t j = 0; j < sizeof(sizes) / sizeof(*sizes); ++j) {
+            int64_t t = run_best(modes[i].mode, sizes[j], modes[i].guest, NULL, 1);
+            if (t < 0)
+                return -1;
+            report("boot", modes[i].mode + 1, sizes[j], t, "ns");
+        }
+    }
+
+    return 0;
+}
+
+// Port I/O exit round trip, with the boot cost subtracted.
+static int bench_pio(uint32_t count) {
+    const uint32_t zero = 0;
+    int64_t base = run_best("-L", "1M", "pio64", &zero, 1);
+    int64_t t = run_best("-L", "1M", "pio64", &count, 1);
+    if (base < 0 || t < 0)
+        return -1;
+
+    report("pio_exit", "L", "1M", (double)(t - base) / count, "ns");
+    return 0;
+}
+
+static int bench_serial(uint32_t mib) {
+    const uint32_t zero = 0;
+    int64_t base = run_best("-L", "1M", "serial64", &zero, 1);
+    int64_t t = run_best("-L", "1M", "serial64", &mib, 1);
+    if (base < 0 || t < 0)
+        return -1;
+
+    report("serial_out", "L", "1M", mib / ((double)(t - base) / 1e9), "MiB/s");
+    return 0;
+}
+
+// HLT exit handling up to process exit, compared to stopping on serial EOF.
+static int bench_hlt(void) {
+    int64_t base = run_best("-L", "1M", "boot64", NULL, 1);
+    int64_t t = run_best("-L", "1M", "hlt64", NULL, 1);
+    if (base < 0 || t < 0)
+        return -1;
+
+    report("hlt_exit", "L", "1M", t - base, "ns");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: blankvm-bench blankvm guest_dir [runs]\n");
+        return EXIT_FAILURE;
+    }
+
+    blankvm = argv[1];
+    guest_dir = argv[2];
+    if (argc == 4 && (runs = atoi(argv[3])) <= 0) {
+        fprintf(stderr, "Bad number of runs: %s\n", argv[3]);
+        return EXIT_FAILURE;
+    }
+
+    if (bench_boot() < 0 || bench_pio(100000) < 0 || bench_serial(16) < 0 || bench_hlt() < 0)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
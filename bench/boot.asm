@@ -0,0 +1,6 @@
+; Stops right away: the first instruction reads the serial port, which is at EOF.
+; Built once per mode with -DBITS=16, 32 or 64.
+bits BITS
+
+    mov dx, 03F8h
+    in al, dx
@@ -0,0 +1,4 @@
+; Halts right away, the time after boot is spent handling the HLT exit.
+bits 64
+
+    hlt
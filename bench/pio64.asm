@@ -0,0 +1,25 @@
+; Exits to blankvm on every iteration: port 500h is a no-op outside of snapshot mode.
+; Reads the iteration count (32-bit little endian) from the serial port first.
+bits 64
+
+    mov dx, 03F8h
+    mov rdi, count
+    mov rcx, 4
+    rep insb
+
+    mov ecx, [count]
+    mov dx, 0500h
+    test ecx, ecx
+    jz done
+
+pio_loop:
+    out dx, al
+    dec ecx
+    jnz pio_loop
+
+done:
+    mov dx, 03F8h
+    in al, dx
+
+count:
+    dd 0
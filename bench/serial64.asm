@@ -0,0 +1,29 @@
+; Writes the given number of MiB (32-bit little endian, read from the serial port)
+; to the serial port in 64K string writes.
+bits 64
+
+buffer equ 10000h
+chunk equ 10000h
+
+    mov dx, 03F8h
+    mov rdi, count
+    mov rcx, 4
+    rep insb
+
+    mov ebx, [count]
+    shl ebx, 4
+    test ebx, ebx
+    jz done
+
+out_loop:
+    mov rsi, buffer
+    mov rcx, chunk
+    rep outsb
+    dec ebx
+    jnz out_loop
+
+done:
+    in al, dx
+
+count:
+    dd 0
@@ -1,26 +1,387 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <linux/kvm.h>
+#include <linux/kvm_para.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include <linux/userfaultfd.h>
+#include <linux/virtio_ring.h>
+#include <zlib.h>
+
+#define SERIAL_PORT 0x3F8
+#define SERIAL_IRQ 4
+#define CONSOLE_PORT 0xE9
+#define CHECKPOINT_PORT 0x500
+#define EXIT_PORT 0x501
+#define DOORBELL_PORT 0x502
+#define QUEUE_PORT 0x503
+#define QUEUE_IRQ 5
+#define SERIAL_BUFFER_SIZE 65536
+#define LIMIT_STATUS 124 // exit status when a time or cycle limit stopped the guest, as with timeout(1)
+
+const size_t PAGE_SIZE = 4096;
+
+#define VM_MAX_REGIONS 128
+#define VM_MAX_NODES 64
+#define VM_MAX_HOST_CPUS 1024
+#define VM_MAX_FILES 16
+
+// Guest physical memory slot registered with KVM
+struct vm_region {
+    uint32_t slot;
+    uint32_t flags;
+    uint64_t guest_addr;
+    uint64_t size;
+    void *host;
+    const char *name;
+};
+
+// Host file mapped into guest physical memory with -f
+struct vm_file {
+    const char *path;
+    size_t guest_addr;
+    int readonly;
+};
+
+struct vm_file_map {
+    void *host;
+    size_t size;
+};
+
+enum serial_flush {
+    SERIAL_FLUSH_FULL,
+    SERIAL_FLUSH_LINE
+};
+
+struct serial {
+    int in_fd;
+    int out_fd;
+    enum serial_flush flush;
+    // in_lock may be held while taking out_lock, never the other way around
+    pthread_mutex_t in_lock;
+    pthread_mutex_t out_lock;
+    // output ring: out_head is the oldest unwritten byte
+    size_t out_head;
+    size_t out_len;
+    uint8_t out[SERIAL_BUFFER_SIZE];
+    size_t in_pos;
+    size_t in_len;
+    uint8_t in[SERIAL_BUFFER_SIZE];
+};
+
+enum vm_stats_format {
+    VM_STATS_NONE,
+    VM_STATS_TEXT,
+    VM_STATS_JSON
+};
+
+#define VM_STATS_REASONS 64
+#define VM_STATS_ADDRS 32
+#define VM_STATS_BUCKETS 48 // bucket i counts times in [2^i, 2^(i+1)) ns
+
+// Port or MMIO address the guest exits on
+struct vm_stats_addr {
+    uint64_t addr;
+    uint8_t mmio;
+    uint8_t write;
+    uint64_t count;
+};
+
+// Exit statistics of one vCPU, only its own thread updates them
+struct vm_stats {
+    uint64_t exits[VM_STATS_REASONS];
+    struct vm_stats_addr addrs[VM_STATS_ADDRS];
+    size_t addr_count;
+    uint64_t other_addrs; // exits on addresses that didn't fit into addrs
+    uint64_t guest_ns;
+    uint64_t guest_hist[VM_STATS_BUCKETS];
+    uint64_t handler_ns;
+    uint64_t handler_hist[VM_STATS_BUCKETS];
+};
+
+// 16550 registers for -i. Input is read ahead by a reader thread into the serial
+// input buffer; all of it is protected by the serial in_lock.
+struct uart {
+    int enabled;
+    uint8_t ier;
+    uint8_t lcr;
+    uint8_t mcr;
+    uint8_t scr;
+    uint8_t dll;
+    uint8_t dlm;
+    uint8_t fcr;
+    int thre_pending;   // THR empty interrupt not yet taken by an IIR read
+    int msr_delta;      // DCD changed since the last MSR read
+    int irq_level;      // interrupt condition as of the last update
+    int eof;
+    int irq_fd;         // eventfd bound to SERIAL_IRQ with KVM_IRQFD
+    int stop_fd;        // eventfd that stops the reader thread
+    int reader_stop;
+    pthread_t reader;
+    pthread_cond_t cond; // input buffer refilled or consumed
+};
+
+// Serial input log for -r: "BVMINPUT", then a record for every read from the data port,
+// the exit it was handled at (counted from boot, as the difference to the previous record)
+// and the number of bytes as LEB128 varints, followed by the bytes.
+#define INPUT_LOG_MAGIC "BVMINPUT"
+#define INPUT_LOG_BUFFER 65536
+
+struct input_log {
+    int fd;             // -1 without -r
+    int replay;
+    uint8_t *data;      // the whole log when replaying, records not written yet when recording
+    size_t size;
+    size_t pos;         // replaying: the next byte of the log
+    size_t left;        // replaying: bytes left in the current record
+    uint64_t exit;      // exit of the current record
+    uint64_t bytes;
+    int diverged;
+};
+
+// Output ring for -o: head (written by the guest), tail (written by the host) and data,
+// each starting a cache line of its own. Indices run freely, the data size is a power of two.
+#define OUTPUT_RING_HEAD 0
+#define OUTPUT_RING_TAIL 64
+#define OUTPUT_RING_DATA 128
+
+// Polling an idle ring: spin that many times, then sleep twice as long every time up to the maximum
+#define OUTPUT_POLL_SPINS 256
+#define OUTPUT_POLL_MIN_SLEEP_NS 16000
+#define OUTPUT_POLL_MAX_SLEEP_NS 1000000
+
+// The guest rings the doorbell after adding data. KVM signals the eventfd without
+// leaving KVM_RUN and a host thread writes the data out while the guest keeps running.
+// With ,poll the thread watches head on its own and the guest needn't ring at all.
+struct output_ring {
+    uint64_t addr;
+    size_t size;
+    int poll;
+    int spins;
+    int doorbell_fd;    // eventfd bound to DOORBELL_PORT with KVM_IOEVENTFD
+    int stop;
+    int failed;
+    pthread_t thread;
+};
+
+#define QUEUE_MAX_SIZE 1024 // a chain always fits into IOV_MAX iovecs
+#define QUEUE_ALIGN 4096
+
+// Split virtqueue for -q in legacy virtio layout: descriptors, avail ring, then the used
+// ring at the next QUEUE_ALIGN boundary. Device-readable buffers are written to stdout and
+// device-writable ones filled from stdin by a host thread woken up with an ioeventfd.
+struct vm_queue {
+    uint64_t addr;
+    unsigned size;
+    struct vring ring;  // points into guest memory
+    uint16_t last_avail;
+    uint16_t used_idx;
+    uint16_t pending[QUEUE_MAX_SIZE]; // heads of chains waiting for input, oldest first
+    unsigned pending_first;
+    unsigned pending_count;
+    int doorbell_fd;    // eventfd bound to QUEUE_PORT with KVM_IOEVENTFD
+    int irq_fd;         // eventfd bound to QUEUE_IRQ with KVM_IRQFD, -1 without the irqchip
+    int irq_pending;    // completions the guest wasn't interrupted for yet
+    int stop;
+    int failed;
+    pthread_t thread;
+};
+
+#define LAZY_BATCH 16       // fault messages read at once
+#define LAZY_READAHEAD 16   // pages filled per fault
+
+struct vm_state;
+
+// Where -u takes a guest page from the first time it is touched
+struct page_source {
+    const char *name;
+    // fills buf with guest memory at [addr, addr + len), which lies in one region
+    int (*fill)(struct vm_state *vm, uint64_t addr, void *buf, size_t len);
+};
+
+// Guest RAM registered with userfaultfd for -u: missing pages are filled by a host
+// thread from the current source, together with the pages right after them.
+struct lazy_mem {
+    int fd;             // userfaultfd, -1 until the first -u VM registers its memory
+    int stop_fd;
+    int image_fd;       // image pages come from here instead of being read at boot
+    const struct page_source *source;
+    void *buf;
+    uint64_t faults;
+    uint64_t pages;
+    int failed;
+    pthread_t thread;
+};
+
+// RIP samples of one vCPU for -k: open addressing on rip, entries with count 0 are free
+struct vm_profile_entry {
+    uint64_t rip;
+    uint64_t count;
+};
+
+struct vm_profile {
+    struct vm_profile_entry *entries;
+    size_t capacity;    // a power of two
+    size_t used;
+    uint64_t samples;
+};
+
+enum vm_dirty_format {
+    VM_DIRTY_NONE,
+    VM_DIRTY_BITMAP,
+    VM_DIRTY_PAGES
+};
+
+enum vm_limit {
+    VM_LIMIT_NONE,
+    VM_LIMIT_TIME,
+    VM_LIMIT_CYCLES
+};
+
+// What vm_run does after an exit handler
+enum vm_exit_action {
+    VM_EXIT_FAIL = -1,
+    VM_EXIT_CONTINUE,
+    VM_EXIT_STOP,       // the guest is done, stop the VM
+    VM_EXIT_HALTED,     // this vCPU is done, others still run
+    VM_EXIT_CHECKPOINT,
+    VM_EXIT_UNHANDLED   // dump the vCPU and fail
+};
+
+#define VM_MAX_DEVICES 32
+#define VM_MAX_MMIO 32
+#define VM_PIO_PORTS 0x10000
+
+struct vm_cpu;
+
+// A device registered for ports and/or MMIO ranges. Its handler gets the exit in the
+// vCPU's kvm_run and the data the port or range was registered with.
+struct vm_device {
+    const char *name;
+    enum vm_exit_action (*handle)(struct vm_cpu *cpu, void *data);
+    void *data;
+};
+
+// Sorted by addr, ranges never overlap
+struct vm_mmio_range {
+    uint64_t addr;
+    uint64_t size;
+    uint8_t device;
+    void *data;
+};
+
+struct vm_cpu {
+    struct vm_state *vm;
+    int id;
+    int fd;
+    int host_cpu;
+    struct kvm_run *run;
+    pthread_t thread;
+    int exited;         // vm_run returned, the thread must not be kicked anymore
+    size_t mmio_hit;    // the MMIO range of the last MMIO exit
+    uint64_t exits;     // exits handled, KVM_RUN interrupted by a signal doesn't count
+    // registers as of the last exit, NULL until someone asks: vm_cpu_regs and vm_cpu_sregs
+    struct kvm_regs *regs_view;
+    struct kvm_sregs *sregs_view;
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct vm_stats stats;
+    struct vm_profile profile;
+};
 
 struct vm_state {
     int kvm;
     int vm;
-    int cpu;
+    struct vm_cpu *cpus;
+    size_t cpu_count;
     void *mem;
     size_t mem_size;
-    struct kvm_run *run;
+    size_t image_size;
+    struct vm_region regions[VM_MAX_REGIONS];
+    size_t region_count;
+    struct vm_file_map files[VM_MAX_FILES];
+    size_t file_count;
+    // device registry: ports map to device index + 1, 0 if nobody handles it
+    struct vm_device devices[VM_MAX_DEVICES];
+    size_t device_count;
+    uint8_t pio[VM_PIO_PORTS];
+    struct vm_mmio_range mmio[VM_MAX_MMIO];
+    size_t mmio_count;
+    enum vm_exit_action (*exit_handlers[VM_STATS_REASONS])(struct vm_cpu *cpu);
+    int rofile_device;
     size_t run_size;
     void *page_table;
     size_t page_table_size;
+    struct kvm_coalesced_mmio_ring *console_ring;
+    struct kvm_cpuid2 *supported_cpuid;
+    uint32_t sync_regs;     // KVM_SYNC_X86_* KVM copies to the kvm_run page on every exit
+    uint32_t tsc_khz;   // passed to the guest, 0 if KVM doesn't know it
+    struct serial serial;
+    struct uart uart;
+    int irqchip;
+    struct output_ring output;
+    struct input_log input_log;
+    struct vm_queue queue;
+    struct lazy_mem lazy;
+    pthread_mutex_t console_lock;
+    pthread_mutex_t dump_lock;
+    pthread_mutex_t kick_lock; // vm_stop against exiting vCPU threads
+    int stop;
+    int exit_status;
+    size_t running_cpus; // vCPUs that haven't halted yet
+    int wait_checkpoint;
+    size_t image_loaded;
+    struct vm_snapshot *snapshot;
+    struct packed_image *packed; // compressed image waiting to be unpacked after boot setup
+    struct vm_cpu_state *reset_state; // per vCPU, only for VMs kept in the server pool
+    enum vm_stats_format stats_format;
+    // KVM binary stats sampled with -M: the VM's first, then every vCPU's
+    struct kvm_stats *kvm_stats;
+    int metrics_fd;
+    uint64_t metrics_interval_ms;
+    pthread_t metrics_thread;
+    pthread_mutex_t metrics_lock;
+    pthread_cond_t metrics_cond;
+    int metrics_stop;
+    // -t and -Y, limit_hit is the one that stopped the guest
+    size_t time_limit_ms;
+    size_t cycle_budget;
+    enum vm_limit limit_hit;
+    pthread_t deadline_thread;
+    pthread_mutex_t deadline_lock;
+    pthread_cond_t deadline_cond;
+    int deadline_stop;
+    size_t profile_hz;
+    int profile_fd;     // folded output, stderr gets a text report without it
+    // -d: with manual protection reading the dirty log doesn't clear it, only snapshots do
+    enum vm_dirty_format dirty_format;
+    int dirty_fd;
+    int dirty_manual;
+    const char *packed_path; // -W: written at the checkpoint
+    int resumed;             // started from the checkpoint of a packed image
 };
 
 enum vm_mode {
@@ -29,419 +390,5709 @@ enum vm_mode {
     VM_MODE_LONG
 };
 
+enum vm_mem_backing {
+    VM_MEM_DEFAULT,
+    VM_MEM_THP,
+    VM_MEM_HUGETLB_2M,
+    VM_MEM_HUGETLB_1G
+};
+
 struct vm_options {
     enum vm_mode mode;
     size_t mem_size;
+    size_t cpu_count;
+    int host_cpus[VM_MAX_HOST_CPUS];
+    size_t host_cpu_count;
+    int nodes[VM_MAX_NODES];
+    size_t node_count;
+    enum vm_mem_backing mem_backing;
+    int mem_prefault;
+    int zero_copy;
+    const char *image_cache;
+    int lazy_mem;
+    const char *packed_path;
+    int cpu_host;
+    int snapshot;
     size_t entry_point;
     int page_table_is_set;
     size_t page_table;
+    size_t pt_page_size;
+    int line_buffered;
+    int irqchip;
+    size_t output_ring_addr;
+    size_t output_ring_size;
+    int output_ring_poll;
+    size_t queue_addr;
+    size_t queue_size;
+    struct vm_file files[VM_MAX_FILES];
+    size_t file_count;
+    int halt_poll_is_set;
+    size_t halt_poll_ns;
+    size_t time_limit_ms;
+    size_t cycle_budget;
+    size_t profile_hz;
+    int profile_fd;
+    enum vm_dirty_format dirty_format;
+    int dirty_fd;
+    enum vm_stats_format stats_format;
+    int metrics_fd;
+    uint64_t metrics_interval_ms;
+    const char *server_path;
+    const char *client_path;
+    const char *batch_path;
+    size_t server_workers;
+    int input_log_fd;
+    int input_log_replay;
 };
 
-static void vm_free(struct vm_state *vm) {
-    if (!vm)
-        return;
+// Points the port at other files, dropping whatever was buffered for the old ones.
+static void serial_attach(struct serial *serial, int in_fd, int out_fd, enum serial_flush flush) {
+    serial->in_fd = in_fd;
+    serial->out_fd = out_fd;
+    serial->flush = flush;
+    serial->out_head = 0;
+    serial->out_len = 0;
+    serial->in_pos = 0;
+    serial->in_len = 0;
+}
 
-    if (vm->run != MAP_FAILED)
-        munmap(vm->run, vm->run_size);
-    if (vm->cpu >= 0)
-        close(vm->cpu);
-    if (vm->vm >= 0)
-        close(vm->vm);
-    if (vm->kvm >= 0)
-        close(vm->kvm);
-    if (vm->mem != MAP_FAILED)
-        munmap(vm->mem, vm->mem_size);
-    if (vm->page_table != MAP_FAILED)
-        munmap(vm->page_table, vm->page_table_size);
+static void serial_init(struct serial *serial, int in_fd, int out_fd, enum serial_flush flush) {
+    serial_attach(serial, in_fd, out_fd, flush);
+    pthread_mutex_init(&serial->in_lock, NULL);
+    pthread_mutex_init(&serial->out_lock, NULL);
+}
 
-    free(vm);
+// Switches input to another file, dropping whatever was buffered from the old one.
+static void serial_reset_input(struct serial *serial, int in_fd) {
+    pthread_mutex_lock(&serial->in_lock);
+    serial->in_fd = in_fd;
+    serial->in_pos = 0;
+    serial->in_len = 0;
+    pthread_mutex_unlock(&serial->in_lock);
 }
 
-static struct vm_state *vm_create(size_t mem_size) {
-    struct vm_state *vm = malloc(sizeof(struct vm_state));
-    if (!vm) {
-        perror("malloc");
-        goto fail;
-    }
+static int serial_flush_locked(struct serial *serial) {
+    while (serial->out_len > 0) {
+        struct iovec iov[2];
+        int iovcnt = 1;
+        size_t first = SERIAL_BUFFER_SIZE - serial->out_head;
+        iov[0].iov_base = serial->out + serial->out_head;
+        iov[0].iov_len = serial->out_len < first ? serial->out_len : first;
+        if (serial->out_len > first) {
+            iov[1].iov_base = serial->out;
+            iov[1].iov_len = serial->out_len - first;
+            iovcnt = 2;
+        }
 
-    vm->kvm = -1;
-    vm->vm = -1;
-    vm->cpu = -1;
-    vm->mem = MAP_FAILED;
-    vm->mem_size = 0;
-    vm->run = MAP_FAILED;
-    vm->run_size = 0;
-    vm->page_table = MAP_FAILED;
-    vm->page_table_size = 0;
+        ssize_t r = writev(serial->out_fd, iov, iovcnt);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write serial");
+            return -1;
+        }
 
-    vm->kvm = open("/dev/kvm", O_RDWR);
-    if (vm->kvm < 0) {
-        perror("open /dev/kvm");
-        goto fail;
+        serial->out_head = (serial->out_head + r) % SERIAL_BUFFER_SIZE;
+        serial->out_len -= r;
     }
 
-    vm->vm = ioctl(vm->kvm, KVM_CREATE_VM, 0);
-    if (vm->vm < 0) {
-        perror("KVM_CREATE_VM");
-        goto fail;
-    }
+    serial->out_head = 0;
+    return 0;
+}
 
-    vm->mem_size = mem_size;
-    vm->mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (vm->mem == MAP_FAILED) {
-        perror("mmap mem");
-        goto fail;
-    }
+static int serial_flush(struct serial *serial) {
+    pthread_mutex_lock(&serial->out_lock);
+    int r = serial_flush_locked(serial);
+    pthread_mutex_unlock(&serial->out_lock);
+    return r;
+}
 
-    struct kvm_userspace_memory_region region = {
-        .slot = 0,
-        .guest_phys_addr = 0,
-        .memory_size = mem_size,
-        .userspace_addr = (uintptr_t)vm->mem
-    };
+static int serial_write_locked(struct serial *serial, const uint8_t *data, size_t len) {
+    int newline = serial->flush == SERIAL_FLUSH_LINE && memchr(data, '\n', len) != NULL;
 
-    if (ioctl(vm->vm, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
-        perror("KVM_SET_USER_MEMORY_REGION");
-        goto fail;
-    }
+    while (len > 0) {
+        if (serial->out_len == SERIAL_BUFFER_SIZE && serial_flush_locked(serial) < 0)
+            return -1;
 
-    vm->cpu = ioctl(vm->vm, KVM_CREATE_VCPU, 0);
-    if (vm->cpu < 0) {
-        perror("KVM_CREATE_VCPU");
-        goto fail;
-    }
+        size_t tail = (serial->out_head + serial->out_len) % SERIAL_BUFFER_SIZE;
+        size_t chunk = tail >= serial->out_head ? SERIAL_BUFFER_SIZE - tail : serial->out_head - tail;
+        if (chunk > len)
+            chunk = len;
 
-    int run_size = ioctl(vm->kvm, KVM_GET_VCPU_MMAP_SIZE, 0);
-    if (run_size < 0) {
-        perror("KVM_GET_VCPU_MMAP_SIZE");
-        goto fail;
+        memcpy(serial->out + tail, data, chunk);
+        serial->out_len += chunk;
+        data += chunk;
+        len -= chunk;
     }
 
-    vm->run_size = run_size;
-    vm->run = mmap(NULL, run_size, PROT_READ | PROT_WRITE, MAP_SHARED, vm->cpu, 0);
-    if (vm->run == MAP_FAILED) {
-        perror("mmap run");
-        goto fail;
-    }
+    if (newline)
+        return serial_flush_locked(serial);
 
-    return vm;
+    return 0;
+}
 
-fail:
-    vm_free(vm);
-    return NULL;
+static int serial_write(struct serial *serial, const uint8_t *data, size_t len) {
+    pthread_mutex_lock(&serial->out_lock);
+    int r = serial_write_locked(serial, data, len);
+    pthread_mutex_unlock(&serial->out_lock);
+    return r;
 }
 
-static int vm_load_image(struct vm_state *vm, const char *path) {
-    int fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        perror("open image");
-        goto fail;
+// Returns number of bytes stored to data (less than len only at EOF) or -1 on error.
+// Fails with EINTR when interrupted by a signal, so a stopping VM doesn't wait for input.
+static ssize_t serial_read_locked(struct serial *serial, uint8_t *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        if (serial->in_pos == serial->in_len) {
+            // guest is about to wait for input, let it see the prompt first
+            if (serial_flush(serial) < 0)
+                return -1;
+
+            ssize_t r = read(serial->in_fd, serial->in, SERIAL_BUFFER_SIZE);
+            if (r < 0) {
+                if (errno != EINTR)
+                    perror("read serial");
+                return -1;
+            }
+            if (r == 0)
+                break;
+
+            serial->in_pos = 0;
+            serial->in_len = r;
+        }
+
+        size_t chunk = serial->in_len - serial->in_pos;
+        if (chunk > len - done)
+            chunk = len - done;
+
+        memcpy(data + done, serial->in + serial->in_pos, chunk);
+        serial->in_pos += chunk;
+        done += chunk;
     }
 
-    ssize_t r = read(fd, vm->mem, vm->mem_size);
-    if (r < 0) {
-        perror("read image");
-        goto fail;
+    return done;
+}
+
+static ssize_t serial_read(struct serial *serial, uint8_t *data, size_t len) {
+    pthread_mutex_lock(&serial->in_lock);
+    ssize_t r = serial_read_locked(serial, data, len);
+    pthread_mutex_unlock(&serial->in_lock);
+    return r;
+}
+
+static int write_full(int fd, const void *data, size_t len) {
+    while (len > 0) {
+        ssize_t r = write(fd, data, len);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data = (const uint8_t*)data + r;
+        len -= r;
     }
 
-    close(fd);
     return 0;
+}
 
-fail:
-    if (fd >= 0)
-        close(fd);
+static int pread_full(int fd, void *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t r = pread(fd, buf, len, offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        buf = (uint8_t*)buf + r;
+        len -= r;
+        offset += r;
+    }
 
-    return -1;
+    return 0;
 }
 
-const size_t PAGE_SIZE = 4096;
+static size_t varint_put(uint8_t *out, uint64_t value) {
+    size_t n = 0;
+    for (; value >= 0x80; value >>= 7)
+        out[n++] = (uint8_t)value | 0x80;
+    out[n++] = (uint8_t)value;
+    return n;
+}
 
-static size_t bytes_to_pages(size_t bytes) {
-    return (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+static int varint_get(const uint8_t *data, size_t size, size_t *pos, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; *pos < size && shift < 64; shift += 7) {
+        const uint8_t byte = data[(*pos)++];
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return 0;
+    }
+    return -1;
 }
 
-static int vm_fill_page_table(struct vm_state *vm, uint64_t *cr3) {
-    const size_t pt_levels = 4;
-    size_t pt_pages = 0;
-    for (size_t level = 0, pages = bytes_to_pages(vm->mem_size); level < pt_levels; ++level) {
-        pages = bytes_to_pages(pages * sizeof(uint64_t));
-        pt_pages += pages;
+static int input_log_setup(struct input_log *log, const struct vm_options *options) {
+    const int fd = options->input_log_fd;
+    log->replay = options->input_log_replay;
+
+    if (!log->replay) {
+        log->data = malloc(INPUT_LOG_BUFFER);
+        if (!log->data) {
+            perror("malloc");
+            return -1;
+        }
+        memcpy(log->data, INPUT_LOG_MAGIC, 8);
+        log->size = 8;
+        log->fd = fd;
+        return 0;
     }
 
-    size_t guest_pt_base = vm->mem_size;
-    vm->page_table_size = pt_pages * PAGE_SIZE;
-    vm->page_table = mmap(NULL, vm->page_table_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (vm->page_table == MAP_FAILED) {
-        perror("mmap page table");
-        goto fail;
+    // the whole log is read up front, replaying never waits for a read
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("stat input log");
+        return -1;
     }
 
-    memset(vm->page_table, 0, vm->page_table_size);
+    log->size = st.st_size;
+    log->data = malloc(log->size ? log->size : 1);
+    if (!log->data) {
+        perror("malloc");
+        return -1;
+    }
 
-    void *pt_base = vm->page_table;
-    for (size_t level = 0, base = 0, pages = bytes_to_pages(vm->mem_size); level < pt_levels; ++level) {
-        uint64_t *pt = (uint64_t*)pt_base;
-        for (size_t i = 0; i < pages; ++i) {
-            pt[i] = base + i * PAGE_SIZE + 0x03; // 3 = present + writable
-        }
+    if (pread_full(fd, log->data, log->size, 0) < 0 || log->size < 8 ||
+            memcmp(log->data, INPUT_LOG_MAGIC, 8) != 0) {
+        fprintf(stderr, "Not an input log\n");
+        free(log->data);
+        log->data = NULL;
+        return -1;
+    }
+    log->pos = 8;
+    log->fd = fd;
+    return 0;
+}
 
-        base = (uint64_t)(pt_base - vm->page_table + guest_pt_base);
-        pages = bytes_to_pages(pages * sizeof(uint64_t));
-        pt_base += pages * PAGE_SIZE;
+// Recording: writes out the buffered records.
+static int input_log_flush(struct input_log *log) {
+    if (log->replay || !log->size)
+        return 0;
+    if (write_full(log->fd, log->data, log->size) < 0) {
+        perror("write input log");
+        return -1;
     }
+    log->size = 0;
+    return 0;
+}
 
-    struct kvm_userspace_memory_region region = {
-        .slot = 1,
-        .guest_phys_addr = guest_pt_base,
-        .memory_size = vm->page_table_size,
-        .userspace_addr = (uintptr_t)vm->page_table,
-    };
+static int input_log_put(struct input_log *log, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        if (log->size == INPUT_LOG_BUFFER && input_log_flush(log) < 0)
+            return -1;
 
-    if (ioctl(vm->vm, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
-        perror("KVM_SET_USER_MEMORY_REGION page table");
-        goto fail;
+        size_t chunk = INPUT_LOG_BUFFER - log->size;
+        if (chunk > len)
+            chunk = len;
+        memcpy(log->data + log->size, data, chunk);
+        log->size += chunk;
+        data += chunk;
+        len -= chunk;
     }
 
-    *cr3 = guest_pt_base + (pt_pages - 1) * PAGE_SIZE;
     return 0;
-
-fail:
-    return -1;
 }
 
-static void vm_setup_segment(struct kvm_segment *seg, enum vm_mode mode, int is_code) {
-    seg->base = 0;
-    seg->selector = mode == VM_MODE_REAL ? 0 : (is_code ? 8 : 16);
-    seg->limit = mode == VM_MODE_REAL ? 0xFFFF : 0xFFFFFFFF;
-    seg->type = is_code ? 0x0B : 0x03;
-    seg->db = mode == VM_MODE_PROTECTED ? 1 : 0;
-    seg->l = mode == VM_MODE_LONG ? 1 : 0;
-    seg->g = mode == VM_MODE_REAL ? 0 : 1;
+// Stores what the guest has just read at the exit it is handling.
+static int input_log_record(struct input_log *log, uint64_t exit, const uint8_t *data, size_t len) {
+    uint8_t header[20];
+    size_t n = varint_put(header, exit - log->exit);
+    n += varint_put(header + n, len);
+    log->exit = exit;
+    log->bytes += len;
+    return input_log_put(log, header, n) < 0 || input_log_put(log, data, len) < 0 ? -1 : 0;
 }
 
-static int vm_prepare_to_boot(struct vm_state *vm, const struct vm_options *options) {
-    struct kvm_regs regs = {};
-    struct kvm_sregs sregs = {};
-
-    if (ioctl(vm->cpu, KVM_GET_REGS, &regs) < 0) {
-        perror("KVM_GET_REGS");
-        goto fail;
-    }
+// Returns the recorded input like a read, 0 at the end of the log. Input that comes
+// at another exit than it did when recording means the run isn't the same anymore.
+static ssize_t input_log_replay(struct input_log *log, uint64_t exit, uint8_t *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        if (log->left == 0) {
+            if (log->pos == log->size)
+                break;
 
-    if (ioctl(vm->cpu, KVM_GET_SREGS, &sregs) < 0) {
-        perror("KVM_GET_SREGS");
-        goto fail;
-    }
+            uint64_t delta = 0, size = 0;
+            if (varint_get(log->data, log->size, &log->pos, &delta) < 0 ||
+                    varint_get(log->data, log->size, &log->pos, &size) < 0 || size > log->size - log->pos) {
+                fprintf(stderr, "Input log is truncated at byte %zu\n", log->pos);
+                return -1;
+            }
+            log->exit += delta;
+            log->left = size;
 
-    switch (options->mode) {
-    case VM_MODE_REAL:
-        if (options->entry_point >= 0x10000) {
-            fprintf(stderr, "Entry point too far for real mode\n");
-            goto fail;
-        }
-        break;
-    case VM_MODE_PROTECTED:
-        if (options->entry_point >= 0x100000000ull) {
-            fprintf(stderr, "Entry point too far for protected mode\n");
-            goto fail;
-        }
-        sregs.cr0 |= 0x00000001; // PE
-        break;
-    case VM_MODE_LONG:
-        if (options->page_table_is_set) {
-            sregs.cr3 = options->page_table;
-        } else {
-            uint64_t cr3 = 0;
-            if (vm_fill_page_table(vm, &cr3) < 0)
-                goto fail;
-            sregs.cr3 = cr3;
+            if (log->exit != exit && !log->diverged) {
+                fprintf(stderr, "Replay diverged: input recorded at exit %llu is read at exit %llu\n",
+                    (unsigned long long)log->exit, (unsigned long long)exit);
+                log->diverged = 1;
+            }
+            continue;
         }
-        sregs.cr0 |= 0x80000001; // PG, PE
-        sregs.cr4 |= 0x00000020; // PAE
-        sregs.efer |= 0x00000500; // LMA, LME
-        break;
+
+        size_t chunk = log->left < len - done ? log->left : len - done;
+        memcpy(data + done, log->data + log->pos, chunk);
+        log->pos += chunk;
+        log->left -= chunk;
+        log->bytes += chunk;
+        done += chunk;
     }
 
-    regs.rip = options->entry_point;
+    return done;
+}
 
-    vm_setup_segment(&sregs.cs, options->mode, 1);
-    vm_setup_segment(&sregs.ds, options->mode, 0);
-    vm_setup_segment(&sregs.es, options->mode, 0);
-    vm_setup_segment(&sregs.fs, options->mode, 0);
-    vm_setup_segment(&sregs.gs, options->mode, 0);
-    vm_setup_segment(&sregs.ss, options->mode, 0);
+static int input_log_close(struct input_log *log) {
+    if (log->fd < 0)
+        return 0;
 
-    if (ioctl(vm->cpu, KVM_SET_REGS, &regs) < 0) {
-        perror("KVM_SET_REGS");
-        goto fail;
-    }
+    int r = input_log_flush(log);
+    if (log->replay && log->pos < log->size)
+        fprintf(stderr, "Replay stopped with %zu bytes of the input log left\n", log->size - log->pos);
+    free(log->data);
+    log->data = NULL;
+    log->fd = -1;
+    return r;
+}
 
-    if (ioctl(vm->cpu, KVM_SET_SREGS, &sregs) < 0) {
-        perror("KVM_SET_SREGS");
-        goto fail;
-    }
+// MSRs the guest can change that are not part of sregs
+static const uint32_t snapshot_msrs[] = {
+    0x00000010, // TSC
+    0x00000174, // SYSENTER_CS
+    0x00000175, // SYSENTER_ESP
+    0x00000176, // SYSENTER_EIP
+    0x00000277, // PAT
+    0xC0000081, // STAR
+    0xC0000082, // LSTAR
+    0xC0000083, // CSTAR
+    0xC0000084, // SYSCALL_MASK
+    0xC0000102, // KERNEL_GS_BASE
+    MSR_KVM_SYSTEM_TIME_NEW, // kvmclock page address
+};
 
-    return 0;
+#define SNAPSHOT_MSR_COUNT (sizeof(snapshot_msrs) / sizeof(*snapshot_msrs))
 
-fail:
-    return -1;
-}
+// vCPU state the guest can change
+struct vm_cpu_state {
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_fpu fpu;
+    struct kvm_vcpu_events events;
+    struct kvm_msrs *msrs;
+    // AVX and AVX-512 registers, only on hosts with XSAVE (nr_xcrs is 0 otherwise)
+    struct kvm_xcrs xcrs;
+    struct kvm_xsave xsave;
+};
 
-static void vm_dump_segment(const char* name, struct kvm_segment *seg) {
-    fprintf(stderr, "%s BASE=%016llx LIM=%08x SEL=%04x ", name, seg->base, seg->limit, seg->selector);
-    fprintf(stderr, "TP=%x P=%x DPL=%x DB=%x S=%x L=%x G=%x A=%x\n",
-        seg->type, seg->present, seg->dpl, seg->db, seg->s, seg->l, seg->g, seg->avl);
-}
+struct vm_snapshot {
+    struct vm_cpu_state cpu;
+    void *mem[VM_MAX_REGIONS]; // contents of the regions at the checkpoint
+    uint64_t *dirty;           // dirty log buffer, big enough for any region
+};
 
-static void vm_dump(const struct vm_state *vm) {
-    fprintf(stderr, "===== BEGIN VM STATE =====\n");
+#define PACKED_MAGIC "BVMIMAGE"
+#define PACKED_VERSION 2
+#define PACKED_CHUNK_SIZE (256 * 1024)
+#define PACKED_MAX_THREADS 64
 
-    const char *exit_reasons[] = {
-        "KVM_EXIT_UNKNOWN", "KVM_EXIT_EXCEPTION", "KVM_EXIT_IO", "KVM_EXIT_HYPERCALL",
-        "KVM_EXIT_DEBUG", "KVM_EXIT_HLT", "KVM_EXIT_MMIO", "KVM_EXIT_IRQ_WINDOW_OPEN",
-        "KVM_EXIT_SHUTDOWN", "KVM_EXIT_FAIL_ENTRY", "KVM_EXIT_INTR", "KVM_EXIT_SET_TPR",
-        "KVM_EXIT_TPR_ACCESS", "KVM_EXIT_S390_SIEIC", "KVM_EXIT_S390_RESET", "KVM_EXIT_DCR",
-        "KVM_EXIT_NMI", "KVM_EXIT_INTERNAL_ERROR", "KVM_EXIT_OSI", "KVM_EXIT_PAPR_HCALL",
-        "KVM_EXIT_S390_UCONTROL", "KVM_EXIT_WATCHDOG", "KVM_EXIT_S390_TSCH", "KVM_EXIT_EPR",
-        "KVM_EXIT_SYSTEM_EVENT", "KVM_EXIT_S390_STSI", "KVM_EXIT_IOAPIC_EOI", "KVM_EXIT_HYPERV"
-    };
+enum packed_encoding {
+    PACKED_ZERO,    // elided, the chunk has no data
+    PACKED_RAW,
+    PACKED_DEFLATE
+};
 
-    const uint32_t exit_reason = vm->run->exit_reason;
-    fprintf(stderr, "Exit reason: %u (%s)\n\n", exit_reason,
-        vm->run->exit_reason < sizeof(exit_reasons)/sizeof(*exit_reasons) ? exit_reasons[exit_reason] : "UNKNOWN");
+// On disk: header words, vCPU state, extents, chunk index, then chunk data. Every extent
+// is cut into chunk_size chunks (the last one may be shorter), indexed in extent order.
+struct packed_header {
+    char magic[8];
+    uint64_t version;
+    uint64_t chunk_size;
+    uint64_t extent_count;
+    uint64_t chunk_count;
+    uint64_t msr_count;
+};
 
-    if (exit_reason == KVM_EXIT_IO) {
-        if (vm->run->io.direction == KVM_EXIT_IO_OUT) {
-            fprintf(stderr, "Write %ux%u bytes at port %04x: ",
-                vm->run->io.count, vm->run->io.size, vm->run->io.port);
-            for (size_t i = 0; i < vm->run->io.count * vm->run->io.size; ++i)
-                fprintf(stderr, "%02x ", ((const uint8_t*)vm->run)[vm->run->io.data_offset + i]);
-            fprintf(stderr, "\n\n");
+struct packed_extent {
+    uint64_t guest_addr;
+    uint64_t size;
+};
+
+struct packed_chunk {
+    uint64_t offset;
+    uint64_t size;      // stored size
+    uint64_t encoding;
+};
+
+// vCPU state as stored after the header, followed by msr_count MSR entries
+struct packed_cpu {
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_fpu fpu;
+    struct kvm_vcpu_events events;
+    struct kvm_xcrs xcrs;
+    struct kvm_xsave xsave;
+};
+
+// An image file in the packed format, opened by vm_load_image
+struct packed_image {
+    int fd;
+    struct packed_header header;
+    struct packed_extent *extents;
+    struct packed_chunk *chunks;
+    struct vm_cpu_state cpu;
+};
+
+static void packed_image_free(struct packed_image *image) {
+    if (!image)
+        return;
+    if (image->fd >= 0)
+        close(image->fd);
+    free(image->extents);
+    free(image->chunks);
+    free(image->cpu.msrs);
+    free(image);
+}
+
+static void vm_snapshot_free(struct vm_state *vm) {
+    struct vm_snapshot *snapshot = vm->snapshot;
+    if (!snapshot)
+        return;
+
+    for (size_t i = 0; i < vm->region_count; ++i) {
+        if (snapshot->mem[i] && snapshot->mem[i] != MAP_FAILED)
+            munmap(snapshot->mem[i], vm->regions[i].size);
+    }
+
+    free(snapshot->cpu.msrs);
+    free(snapshot->dirty);
+    free(snapshot);
+    vm->snapshot = NULL;
+}
+
+// Binary stats of a VM or vCPU. Descriptors are read once, each sample is a single
+// pread of the data block.
+struct kvm_stats {
+    int fd;
+    struct kvm_stats_header header;
+    uint8_t *descs;   // header.num_desc descriptors, each followed by its name
+    size_t desc_size;
+    uint64_t *data;
+    size_t data_size;
+};
+
+static void kvm_stats_close(struct kvm_stats *stats) {
+    if (stats->fd >= 0)
+        close(stats->fd);
+    free(stats->descs);
+    free(stats->data);
+}
+
+static void vm_free(struct vm_state *vm) {
+    if (!vm)
+        return;
+
+    for (size_t i = 0; vm->kvm_stats && i <= vm->cpu_count; ++i)
+        kvm_stats_close(&vm->kvm_stats[i]);
+    free(vm->kvm_stats);
+    input_log_close(&vm->input_log);
+    pthread_mutex_destroy(&vm->metrics_lock);
+    pthread_cond_destroy(&vm->metrics_cond);
+    pthread_mutex_destroy(&vm->deadline_lock);
+    pthread_cond_destroy(&vm->deadline_cond);
+    if (vm->uart.irq_fd >= 0)
+        close(vm->uart.irq_fd);
+    if (vm->uart.stop_fd >= 0)
+        close(vm->uart.stop_fd);
+    pthread_cond_destroy(&vm->uart.cond);
+    if (vm->output.doorbell_fd >= 0)
+        close(vm->output.doorbell_fd);
+    if (vm->queue.doorbell_fd >= 0)
+        close(vm->queue.doorbell_fd);
+    if (vm->queue.irq_fd >= 0)
+        close(vm->queue.irq_fd);
+    if (vm->lazy.stop_fd >= 0) {
+        const uint64_t one = 1;
+        if (write(vm->lazy.stop_fd, &one, sizeof(one)) != sizeof(one))
+            perror("write eventfd");
+        pthread_join(vm->lazy.thread, NULL);
+        close(vm->lazy.stop_fd);
+    }
+    if (vm->lazy.fd >= 0)
+        close(vm->lazy.fd);
+    if (vm->lazy.image_fd >= 0)
+        close(vm->lazy.image_fd);
+    if (vm->lazy.buf)
+        munmap(vm->lazy.buf, LAZY_READAHEAD * PAGE_SIZE);
+
+    for (size_t i = 0; vm->cpus && i < vm->cpu_count; ++i) {
+        free(vm->cpus[i].profile.entries);
+        if (vm->cpus[i].run != MAP_FAILED)
+            munmap(vm->cpus[i].run, vm->run_size);
+        if (vm->cpus[i].fd >= 0)
+            close(vm->cpus[i].fd);
+    }
+    free(vm->cpus);
+
+    if (vm->vm >= 0)
+        close(vm->vm);
+    if (vm->kvm >= 0)
+        close(vm->kvm);
+    if (vm->mem != MAP_FAILED)
+        munmap(vm->mem, vm->mem_size);
+    if (vm->page_table != MAP_FAILED)
+        munmap(vm->page_table, vm->page_table_size);
+    for (size_t i = 0; i < vm->file_count; ++i)
+        munmap(vm->files[i].host, vm->files[i].size);
+
+    vm_snapshot_free(vm);
+    packed_image_free(vm->packed);
+    for (size_t i = 0; vm->reset_state && i < vm->cpu_count; ++i)
+        free(vm->reset_state[i].msrs);
+    free(vm->reset_state);
+    free(vm->supported_cpuid);
+    pthread_mutex_destroy(&vm->console_lock);
+    pthread_mutex_destroy(&vm->dump_lock);
+    pthread_mutex_destroy(&vm->kick_lock);
+    free(vm);
+}
+
+// Writes to the console port are queued by KVM in the coalesced ring instead of
+// causing an exit. Without coalesced PIO they still work as ordinary exits.
+static void vm_setup_console(struct vm_state *vm) {
+    int ring_page = ioctl(vm->kvm, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+    if (ring_page <= 0 || ioctl(vm->kvm, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO) <= 0)
+        return;
+
+    if ((ring_page + 1) * PAGE_SIZE > vm->run_size)
+        return;
+
+    struct kvm_coalesced_mmio_zone zone = {
+        .addr = CONSOLE_PORT,
+        .size = 1,
+        .pio = 1
+    };
+
+    if (ioctl(vm->vm, KVM_REGISTER_COALESCED_MMIO, &zone) < 0) {
+        perror("KVM_REGISTER_COALESCED_MMIO console");
+        return;
+    }
+
+    // the ring is per VM, every vCPU maps the same page
+    vm->console_ring = (struct kvm_coalesced_mmio_ring*)((uint8_t*)vm->cpus[0].run + ring_page * PAGE_SIZE);
+}
+
+static size_t bytes_to_pages(size_t bytes) {
+    return (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+// Returns the index of the new device for vm_register_pio and vm_register_mmio.
+static int vm_add_device(struct vm_state *vm, const char *name,
+        enum vm_exit_action (*handle)(struct vm_cpu *cpu, void *data), void *data) {
+    if (vm->device_count == VM_MAX_DEVICES) {
+        fprintf(stderr, "Too many devices\n");
+        return -1;
+    }
+
+    vm->devices[vm->device_count] = (struct vm_device){ name, handle, data };
+    return vm->device_count++;
+}
+
+static int vm_register_pio(struct vm_state *vm, int device, uint16_t port, size_t count) {
+    for (size_t i = port; i < (size_t)port + count; ++i) {
+        if (i >= VM_PIO_PORTS || vm->pio[i]) {
+            fprintf(stderr, "Port 0x%zx of %s is taken by %s\n", i, vm->devices[device].name,
+                i < VM_PIO_PORTS ? vm->devices[vm->pio[i] - 1].name : "nobody");
+            return -1;
+        }
+    }
+
+    memset(vm->pio + port, device + 1, count);
+    return 0;
+}
+
+static int vm_register_mmio(struct vm_state *vm, int device, uint64_t addr, uint64_t size, void *data) {
+    if (vm->mmio_count == VM_MAX_MMIO) {
+        fprintf(stderr, "Too many MMIO ranges\n");
+        return -1;
+    }
+
+    size_t i = 0;
+    while (i < vm->mmio_count && vm->mmio[i].addr < addr)
+        ++i;
+    if ((i > 0 && vm->mmio[i - 1].addr + vm->mmio[i - 1].size > addr) ||
+            (i < vm->mmio_count && addr + size > vm->mmio[i].addr)) {
+        fprintf(stderr, "MMIO range of %s at 0x%llx overlaps another one\n", vm->devices[device].name,
+            (unsigned long long)addr);
+        return -1;
+    }
+
+    memmove(&vm->mmio[i + 1], &vm->mmio[i], (vm->mmio_count - i) * sizeof(struct vm_mmio_range));
+    vm->mmio[i] = (struct vm_mmio_range){ addr, size, device, data };
+    ++vm->mmio_count;
+    return 0;
+}
+
+// Drops the MMIO ranges of a device, e.g. of files mapped for the last job.
+static void vm_unregister_mmio(struct vm_state *vm, int device) {
+    size_t kept = 0;
+    for (size_t i = 0; i < vm->mmio_count; ++i) {
+        if (vm->mmio[i].device != device)
+            vm->mmio[kept++] = vm->mmio[i];
+    }
+    vm->mmio_count = kept;
+}
+
+static int vm_add_region(struct vm_state *vm, uint64_t guest_addr, uint64_t size, void *host, uint32_t flags,
+        const char *name) {
+    if (vm->region_count == VM_MAX_REGIONS) {
+        fprintf(stderr, "Too many memory regions\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < vm->region_count; ++i) {
+        const struct vm_region *other = &vm->regions[i];
+        if (guest_addr < other->guest_addr + other->size && other->guest_addr < guest_addr + size) {
+            fprintf(stderr, "Memory region %s overlaps %s\n", name, other->name);
+            return -1;
+        }
+    }
+
+    struct vm_region *r = &vm->regions[vm->region_count];
+    r->slot = vm->region_count;
+    r->flags = flags;
+    r->guest_addr = guest_addr;
+    r->size = size;
+    r->host = host;
+    r->name = name;
+
+    struct kvm_userspace_memory_region region = {
+        .slot = r->slot,
+        .flags = flags,
+        .guest_phys_addr = guest_addr,
+        .memory_size = size,
+        .userspace_addr = (uintptr_t)host
+    };
+
+    if (ioctl(vm->vm, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
+        fprintf(stderr, "KVM_SET_USER_MEMORY_REGION %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    ++vm->region_count;
+    return 0;
+}
+
+static size_t vm_mem_alignment(enum vm_mem_backing backing) {
+    switch (backing) {
+    case VM_MEM_THP:
+    case VM_MEM_HUGETLB_2M:
+        return 2 * 1024 * 1024;
+    case VM_MEM_HUGETLB_1G:
+        return 1024 * 1024 * 1024;
+    default:
+        return PAGE_SIZE;
+    }
+}
+
+// Maps fresh guest memory, replacing whatever was mapped at addr if it is given.
+static void *vm_alloc_mem(void *addr, size_t size, const struct vm_options *options) {
+    const size_t align = vm_mem_alignment(options->mem_backing);
+    // guests rarely touch all of their memory, don't charge it all against overcommit
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | (addr ? MAP_FIXED : 0);
+
+    switch (options->mem_backing) {
+    case VM_MEM_HUGETLB_2M:
+        flags |= MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+        break;
+    case VM_MEM_HUGETLB_1G:
+        flags |= MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+        break;
+    default:
+        break;
+    }
+
+    if (options->mem_backing != VM_MEM_THP || addr) {
+        void *mem = mmap(addr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (mem == MAP_FAILED)
+            perror("mmap mem");
+        else if (options->mem_backing == VM_MEM_THP && madvise(mem, size, MADV_HUGEPAGE) < 0)
+            perror("madvise MADV_HUGEPAGE");
+        return mem;
+    }
+
+    // THP needs 2M aligned host addresses, otherwise KVM can't use large EPT entries either
+    uint8_t *raw = mmap(NULL, size + align, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (raw == MAP_FAILED) {
+        perror("mmap mem");
+        return MAP_FAILED;
+    }
+
+    uint8_t *mem = (uint8_t*)(((uintptr_t)raw + align - 1) & ~(align - 1));
+    if (mem > raw)
+        munmap(raw, mem - raw);
+    munmap(mem + size, raw + align - mem);
+
+    if (madvise(mem, size, MADV_HUGEPAGE) < 0)
+        perror("madvise MADV_HUGEPAGE");
+
+    return mem;
+}
+
+// huge pages can't be partially mapped
+static size_t vm_aligned_mem_size(const struct vm_options *options) {
+    const size_t align = vm_mem_alignment(options->mem_backing);
+    return (options->mem_size + align - 1) & ~(align - 1);
+}
+
+// Memory is split evenly between the NUMA nodes, in the order they were given.
+static void vm_node_range(const struct vm_state *vm, const struct vm_options *options, size_t node,
+        size_t *begin, size_t *end) {
+    const size_t count = options->node_count ? options->node_count : 1;
+    const size_t align = vm_mem_alignment(options->mem_backing);
+    const size_t chunk = (vm->mem_size / count + align - 1) & ~(align - 1);
+
+    *begin = node * chunk < vm->mem_size ? node * chunk : vm->mem_size;
+    *end = node + 1 == count || (node + 1) * chunk > vm->mem_size ? vm->mem_size : (node + 1) * chunk;
+}
+
+static int vm_bind_mem(struct vm_state *vm, const struct vm_options *options) {
+    for (size_t i = 0; i < options->node_count; ++i) {
+        size_t begin = 0, end = 0;
+        vm_node_range(vm, options, i, &begin, &end);
+        if (begin == end)
+            continue;
+
+        unsigned long mask[VM_MAX_NODES / (8 * sizeof(unsigned long))] = {};
+        const size_t bits = 8 * sizeof(unsigned long);
+        mask[options->nodes[i] / bits] |= 1ul << (options->nodes[i] % bits);
+
+        if (syscall(SYS_mbind, (uint8_t*)vm->mem + begin, end - begin, MPOL_BIND, mask, VM_MAX_NODES + 1,
+                MPOL_MF_STRICT | MPOL_MF_MOVE) < 0) {
+            fprintf(stderr, "mbind node %d: %s\n", options->nodes[i], strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void vm_prefault_mem(struct vm_state *vm, const struct vm_options *options) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(vm->mem, vm->mem_size, MADV_POPULATE_WRITE) == 0)
+        return;
+#endif
+    const size_t step = vm_mem_alignment(options->mem_backing);
+    for (size_t offset = 0; offset < vm->mem_size; offset += step)
+        ((volatile uint8_t*)vm->mem)[offset] = 0;
+}
+
+static uint32_t vm_region_flags(const struct vm_options *options) {
+    // snapshot restore only copies back the pages the guest wrote
+    return options->snapshot || options->dirty_format != VM_DIRTY_NONE ? KVM_MEM_LOG_DIRTY_PAGES : 0;
+}
+
+// Maps -f files at their guest addresses, straight from the page cache. Guest writes to a
+// writable file stay private to the VM, read-only ones get a read-only slot where writes exit as MMIO.
+static int vm_map_files(struct vm_state *vm, const struct vm_options *options) {
+    for (size_t i = 0; i < options->file_count; ++i) {
+        const struct vm_file *file = &options->files[i];
+
+        if (file->readonly && ioctl(vm->kvm, KVM_CHECK_EXTENSION, KVM_CAP_READONLY_MEM) <= 0) {
+            fprintf(stderr, "Read-only memory is not supported\n");
+            return -1;
+        }
+
+        int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "open %s: %s\n", file->path, strerror(errno));
+            return -1;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size == 0) {
+            fprintf(stderr, "Can't map %s: %s\n", file->path, st.st_size == 0 ? "empty file" : strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        // the tail of the last page reads as zeroes
+        const size_t size = bytes_to_pages(st.st_size) * PAGE_SIZE;
+        const int prot = file->readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+        void *host = mmap(NULL, size, prot, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (host == MAP_FAILED) {
+            fprintf(stderr, "mmap %s: %s\n", file->path, strerror(errno));
+            return -1;
+        }
+
+        vm->files[vm->file_count].host = host;
+        vm->files[vm->file_count].size = size;
+        ++vm->file_count;
+
+        const uint32_t flags = file->readonly ? KVM_MEM_READONLY : vm_region_flags(options);
+        if (vm_add_region(vm, file->guest_addr, size, host, flags, file->path) < 0)
+            return -1;
+
+        // writes to a read-only slot are MMIO exits
+        if (file->readonly && vm->rofile_device >= 0 &&
+                vm_register_mmio(vm, vm->rofile_device, file->guest_addr, size, (void*)file->path) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void vm_unmap_files(struct vm_state *vm) {
+    for (size_t i = 0; i < vm->file_count; ++i)
+        munmap(vm->files[i].host, vm->files[i].size);
+    vm->file_count = 0;
+    if (vm->rofile_device >= 0)
+        vm_unregister_mmio(vm, vm->rofile_device);
+}
+
+static int page_source_image_fill(struct vm_state *vm, uint64_t addr, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len && addr + done < vm->image_loaded) {
+        const size_t left = vm->image_loaded - (addr + done);
+        ssize_t r = pread(vm->lazy.image_fd, (uint8_t*)buf + done, left < len - done ? left : len - done, addr + done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            perror("read image");
+            return -1;
+        }
+        // a file that shrank reads as zeroes
+        if (r == 0)
+            break;
+        done += r;
+    }
+
+    memset((uint8_t*)buf + done, 0, len - done);
+    return 0;
+}
+
+static int page_source_snapshot_fill(struct vm_state *vm, uint64_t addr, void *buf, size_t len) {
+    for (size_t i = 0; i < vm->region_count; ++i) {
+        const struct vm_region *region = &vm->regions[i];
+        if (addr >= region->guest_addr && addr - region->guest_addr < region->size && vm->snapshot->mem[i]) {
+            memcpy(buf, (const uint8_t*)vm->snapshot->mem[i] + (addr - region->guest_addr), len);
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "No snapshot of page %llx\n", (unsigned long long)addr);
+    return -1;
+}
+
+// Pages of the image (zeroes past it) until the checkpoint, then the checkpoint's contents
+static const struct page_source page_source_image = { "image", page_source_image_fill };
+static const struct page_source page_source_snapshot = { "snapshot", page_source_snapshot_fill };
+
+// Resolves a fault at host address addr, filling the pages after it along with it,
+// up to the end of its region or the first page that is there already.
+static int lazy_fill(struct vm_state *vm, uint64_t host_addr) {
+    struct lazy_mem *lazy = &vm->lazy;
+    const uint64_t addr = (host_addr - (uintptr_t)vm->mem) & ~(uint64_t)(PAGE_SIZE - 1);
+
+    uint64_t end = addr + PAGE_SIZE;
+    for (size_t i = 0; i < vm->region_count; ++i) {
+        const struct vm_region *region = &vm->regions[i];
+        if (addr >= region->guest_addr && addr - region->guest_addr < region->size) {
+            end = addr + LAZY_READAHEAD * PAGE_SIZE;
+            if (end > region->guest_addr + region->size)
+                end = region->guest_addr + region->size;
+        }
+    }
+
+    const struct page_source *source = __atomic_load_n(&lazy->source, __ATOMIC_ACQUIRE);
+    if (source->fill(vm, addr, lazy->buf, end - addr) < 0)
+        return -1;
+
+    struct uffdio_copy copy = {
+        .dst = (uintptr_t)vm->mem + addr,
+        .src = (uintptr_t)lazy->buf,
+        .len = end - addr
+    };
+    for (;;) {
+        // a partial copy stopped at a page that is there already, the faulting one is done
+        if (ioctl(lazy->fd, UFFDIO_COPY, &copy) == 0 || copy.copy > 0) {
+            __atomic_fetch_add(&lazy->pages, copy.copy / PAGE_SIZE, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        // filled by an earlier read-ahead, only the faulting thread is left to wake
+        if (errno == EEXIST) {
+            struct uffdio_range range = {
+                .start = (uintptr_t)vm->mem + addr,
+                .len = PAGE_SIZE
+            };
+            if (ioctl(lazy->fd, UFFDIO_WAKE, &range) < 0) {
+                perror("UFFDIO_WAKE");
+                return -1;
+            }
+            return 0;
+        }
+
+        if (errno != EAGAIN) {
+            perror("UFFDIO_COPY");
+            return -1;
+        }
+    }
+}
+
+// A page that couldn't be filled is zeroed, so nothing waits for it forever,
+// and the vCPUs stop at their next exit.
+static void lazy_fail(struct vm_state *vm, uint64_t host_addr) {
+    __atomic_store_n(&vm->lazy.failed, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&vm->stop, 1, __ATOMIC_RELEASE);
+
+    struct uffdio_zeropage zero = {
+        .range = {
+            .start = host_addr & ~(uint64_t)(PAGE_SIZE - 1),
+            .len = PAGE_SIZE
+        }
+    };
+    if (ioctl(vm->lazy.fd, UFFDIO_ZEROPAGE, &zero) < 0 && errno != EEXIST)
+        perror("UFFDIO_ZEROPAGE");
+}
+
+static void *lazy_thread(void *arg) {
+    struct vm_state *vm = arg;
+    struct lazy_mem *lazy = &vm->lazy;
+    struct uffd_msg msgs[LAZY_BATCH];
+    struct pollfd fds[2] = {
+        { .fd = lazy->fd, .events = POLLIN },
+        { .fd = lazy->stop_fd, .events = POLLIN }
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll userfaultfd");
+            break;
+        }
+        if (fds[1].revents)
+            return NULL;
+
+        ssize_t r = read(lazy->fd, msgs, sizeof(msgs));
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            perror("read userfaultfd");
+            break;
+        }
+
+        for (size_t i = 0; i < (size_t)r / sizeof(*msgs); ++i) {
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT)
+                continue;
+            __atomic_fetch_add(&lazy->faults, 1, __ATOMIC_RELAXED);
+            if (lazy_fill(vm, msgs[i].arg.pagefault.address) < 0)
+                lazy_fail(vm, msgs[i].arg.pagefault.address);
+        }
+    }
+
+    __atomic_store_n(&lazy->failed, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int lazy_setup(struct vm_state *vm) {
+    struct lazy_mem *lazy = &vm->lazy;
+
+    // KVM touches guest memory from the kernel, so no UFFD_USER_MODE_ONLY
+    lazy->fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (lazy->fd < 0) {
+        perror("userfaultfd");
+        return -1;
+    }
+
+    struct uffdio_api api = {
+        .api = UFFD_API
+    };
+    if (ioctl(lazy->fd, UFFDIO_API, &api) < 0) {
+        perror("UFFDIO_API");
+        return -1;
+    }
+
+    lazy->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (lazy->stop_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    lazy->buf = mmap(NULL, LAZY_READAHEAD * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (lazy->buf == MAP_FAILED) {
+        lazy->buf = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    int err = pthread_create(&lazy->thread, NULL, lazy_thread, vm);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        close(lazy->stop_fd);
+        lazy->stop_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+// From here on missing pages of guest RAM are filled by the lazy thread. Freshly mapped
+// memory of a reset VM has to be registered again.
+static int vm_lazy_register(struct vm_state *vm, const struct vm_options *options) {
+    if (!options->lazy_mem)
+        return 0;
+    if (vm->lazy.fd < 0 && lazy_setup(vm) < 0)
+        return -1;
+
+    __atomic_store_n(&vm->lazy.source, &page_source_image, __ATOMIC_RELEASE);
+    struct uffdio_register reg = {
+        .range = {
+            .start = (uintptr_t)vm->mem,
+            .len = vm->mem_size
+        },
+        .mode = UFFDIO_REGISTER_MODE_MISSING
+    };
+    if (ioctl(vm->lazy.fd, UFFDIO_REGISTER, &reg) < 0) {
+        perror("UFFDIO_REGISTER");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Registers guest memory after the image is in place: a zero-copy image gets a slot
+// of its own, the rest gets one slot per NUMA node. Files come after it.
+
+static int vm_register_mem(struct vm_state *vm, const struct vm_options *options) {
+    const uint32_t flags = vm_region_flags(options);
+
+    if (vm->image_size > 0 && vm_add_region(vm, 0, vm->image_size, vm->mem, flags, "image") < 0)
+        return -1;
+
+    const size_t count = options->node_count ? options->node_count : 1;
+    for (size_t i = 0; i < count; ++i) {
+        size_t begin = 0, end = 0;
+        vm_node_range(vm, options, i, &begin, &end);
+        if (begin < vm->image_size)
+            begin = vm->image_size < end ? vm->image_size : end;
+        if (begin == end)
+            continue;
+
+        if (vm_add_region(vm, begin, end - begin, (uint8_t*)vm->mem + begin, flags, "mem") < 0)
+            return -1;
+    }
+
+    if (vm_lazy_register(vm, options) < 0)
+        return -1;
+
+    return vm_map_files(vm, options);
+}
+
+// In-kernel PIC, IOAPIC and local APICs, with the UART interrupt raised through an irqfd.
+static int vm_setup_irqchip(struct vm_state *vm) {
+    if (ioctl(vm->vm, KVM_CREATE_IRQCHIP, 0) < 0) {
+        perror("KVM_CREATE_IRQCHIP");
+        return -1;
+    }
+
+    vm->uart.irq_fd = eventfd(0, EFD_CLOEXEC);
+    vm->uart.stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (vm->uart.irq_fd < 0 || vm->uart.stop_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    struct kvm_irqfd irqfd = {
+        .fd = vm->uart.irq_fd,
+        .gsi = SERIAL_IRQ
+    };
+
+    if (ioctl(vm->vm, KVM_IRQFD, &irqfd) < 0) {
+        perror("KVM_IRQFD");
+        return -1;
+    }
+
+    vm->irqchip = 1;
+    vm->uart.enabled = 1;
+    return 0;
+}
+
+static int vm_setup_output_ring(struct vm_state *vm, const struct vm_options *options) {
+    const size_t addr = options->output_ring_addr;
+    const size_t size = options->output_ring_size;
+    if (addr > options->mem_size || options->mem_size - addr < OUTPUT_RING_DATA + size || addr % 64 != 0) {
+        fprintf(stderr, "Output ring doesn't fit into guest memory\n");
+        return -1;
+    }
+
+    if (ioctl(vm->kvm, KVM_CHECK_EXTENSION, KVM_CAP_IOEVENTFD) <= 0) {
+        fprintf(stderr, "ioeventfd is not supported\n");
+        return -1;
+    }
+
+    vm->output.doorbell_fd = eventfd(0, EFD_CLOEXEC);
+    if (vm->output.doorbell_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    // length 0 matches writes of any size
+    struct kvm_ioeventfd ioeventfd = {
+        .addr = DOORBELL_PORT,
+        .len = 0,
+        .fd = vm->output.doorbell_fd,
+        .flags = KVM_IOEVENTFD_FLAG_PIO
+    };
+
+    if (ioctl(vm->vm, KVM_IOEVENTFD, &ioeventfd) < 0) {
+        perror("KVM_IOEVENTFD");
+        return -1;
+    }
+
+    vm->output.addr = addr;
+    vm->output.size = size;
+    vm->output.poll = options->output_ring_poll;
+    // spinning on a single host CPU only takes time away from the vCPU
+    cpu_set_t cpus;
+    vm->output.spins = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) > 1 ? OUTPUT_POLL_SPINS : 0;
+    return 0;
+}
+
+static int vm_setup_queue(struct vm_state *vm, const struct vm_options *options) {
+    struct vm_queue *queue = &vm->queue;
+    const size_t addr = options->queue_addr;
+    const size_t ring_size = vring_size(options->queue_size, QUEUE_ALIGN);
+    if (addr > options->mem_size || options->mem_size - addr < ring_size || addr % QUEUE_ALIGN != 0) {
+        fprintf(stderr, "Queue doesn't fit into guest memory\n");
+        return -1;
+    }
+
+    if (ioctl(vm->kvm, KVM_CHECK_EXTENSION, KVM_CAP_IOEVENTFD) <= 0) {
+        fprintf(stderr, "ioeventfd is not supported\n");
+        return -1;
+    }
+
+    queue->doorbell_fd = eventfd(0, EFD_CLOEXEC);
+    if (queue->doorbell_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    struct kvm_ioeventfd ioeventfd = {
+        .addr = QUEUE_PORT,
+        .len = 0,
+        .fd = queue->doorbell_fd,
+        .flags = KVM_IOEVENTFD_FLAG_PIO
+    };
+
+    if (ioctl(vm->vm, KVM_IOEVENTFD, &ioeventfd) < 0) {
+        perror("KVM_IOEVENTFD queue");
+        return -1;
+    }
+
+    // without the irqchip the guest polls the used ring
+    if (vm->irqchip) {
+        queue->irq_fd = eventfd(0, EFD_CLOEXEC);
+        if (queue->irq_fd < 0) {
+            perror("eventfd");
+            return -1;
+        }
+
+        struct kvm_irqfd irqfd = {
+            .fd = queue->irq_fd,
+            .gsi = QUEUE_IRQ
+        };
+
+        if (ioctl(vm->vm, KVM_IRQFD, &irqfd) < 0) {
+            perror("KVM_IRQFD queue");
+            return -1;
+        }
+    }
+
+    queue->addr = addr;
+    queue->size = options->queue_size;
+    vring_init(&queue->ring, queue->size, (uint8_t*)vm->mem + addr, QUEUE_ALIGN);
+    return 0;
+}
+
+// Lets the dirty report read the log without taking it away from snapshot restores.
+static int vm_enable_manual_dirty_log(struct vm_state *vm) {
+    int caps = ioctl(vm->kvm, KVM_CHECK_EXTENSION, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
+    if (caps <= 0 || !(caps & KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE)) {
+        fprintf(stderr, "Manual dirty log protection is not supported\n");
+        return -1;
+    }
+
+    struct kvm_enable_cap cap = {
+        .cap = KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2,
+        .args = { KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE }
+    };
+
+    if (ioctl(vm->vm, KVM_ENABLE_CAP, &cap) < 0) {
+        perror("KVM_ENABLE_CAP manual dirty log");
+        return -1;
+    }
+
+    vm->dirty_manual = 1;
+    return 0;
+}
+
+// Only halts KVM handles itself are polled, i.e. with the in-kernel irqchip.
+static int vm_set_halt_poll(struct vm_state *vm, size_t ns) {
+    if (ioctl(vm->kvm, KVM_CHECK_EXTENSION, KVM_CAP_HALT_POLL) <= 0) {
+        fprintf(stderr, "Halt polling control is not supported\n");
+        return -1;
+    }
+
+    struct kvm_enable_cap cap = {
+        .cap = KVM_CAP_HALT_POLL,
+        .args = { ns }
+    };
+
+    if (ioctl(vm->vm, KVM_ENABLE_CAP, &cap) < 0) {
+        perror("KVM_ENABLE_CAP halt poll");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int kvm_stats_open(struct kvm_stats *stats, int owner) {
+    stats->fd = ioctl(owner, KVM_GET_STATS_FD, 0);
+    if (stats->fd < 0) {
+        perror("KVM_GET_STATS_FD");
+        return -1;
+    }
+
+    if (pread(stats->fd, &stats->header, sizeof(stats->header), 0) != sizeof(stats->header)) {
+        perror("read stats header");
+        return -1;
+    }
+
+    stats->desc_size = sizeof(struct kvm_stats_desc) + stats->header.name_size;
+    const size_t descs_size = stats->header.num_desc * stats->desc_size;
+    stats->descs = malloc(descs_size);
+    if (!stats->descs) {
+        perror("malloc");
+        return -1;
+    }
+
+    if (pread(stats->fd, stats->descs, descs_size, stats->header.desc_offset) != (ssize_t)descs_size) {
+        perror("read stats descriptors");
+        return -1;
+    }
+
+    for (size_t i = 0; i < stats->header.num_desc; ++i) {
+        const struct kvm_stats_desc *desc = (const struct kvm_stats_desc*)(stats->descs + i * stats->desc_size);
+        const size_t end = desc->offset + desc->size * sizeof(uint64_t);
+        if (end > stats->data_size)
+            stats->data_size = end;
+    }
+
+    stats->data = malloc(stats->data_size);
+    if (!stats->data) {
+        perror("malloc");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int vm_open_kvm_stats(struct vm_state *vm) {
+    if (ioctl(vm->kvm, KVM_CHECK_EXTENSION, KVM_CAP_BINARY_STATS_FD) <= 0) {
+        fprintf(stderr, "KVM binary stats are not supported\n");
+        return -1;
+    }
+
+    vm->kvm_stats = calloc(vm->cpu_count + 1, sizeof(struct kvm_stats));
+    if (!vm->kvm_stats) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (size_t i = 0; i <= vm->cpu_count; ++i)
+        vm->kvm_stats[i].fd = -1;
+
+    if (kvm_stats_open(&vm->kvm_stats[0], vm->vm) < 0)
+        return -1;
+
+    for (size_t i = 0; i < vm->cpu_count; ++i) {
+        if (kvm_stats_open(&vm->kvm_stats[i + 1], vm->cpus[i].fd) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static struct vm_state *vm_create(const struct vm_options *options) {
+    struct vm_state *vm = malloc(sizeof(struct vm_state));
+    if (!vm) {
+        perror("malloc");
+        goto fail;
+    }
+
+    vm->kvm = -1;
+    vm->vm = -1;
+    vm->cpus = NULL;
+    vm->cpu_count = 0;
+    vm->mem = MAP_FAILED;
+    vm->mem_size = 0;
+    vm->image_size = 0;
+    vm->region_count = 0;
+    vm->file_count = 0;
+    vm->device_count = 0;
+    memset(vm->pio, 0, sizeof(vm->pio));
+    vm->mmio_count = 0;
+    memset(vm->exit_handlers, 0, sizeof(vm->exit_handlers));
+    vm->rofile_device = -1;
+    vm->run_size = 0;
+    vm->page_table = MAP_FAILED;
+    vm->page_table_size = 0;
+    vm->console_ring = NULL;
+    vm->supported_cpuid = NULL;
+    vm->tsc_khz = 0;
+    vm->stop = 0;
+    vm->exit_status = 0;
+    vm->running_cpus = 0;
+    vm->irqchip = 0;
+    vm->sync_regs = 0;
+    vm->wait_checkpoint = options->snapshot;
+    vm->image_loaded = 0;
+    vm->snapshot = NULL;
+    vm->packed = NULL;
+    vm->reset_state = NULL;
+    vm->stats_format = options->stats_format;
+    vm->kvm_stats = NULL;
+    vm->metrics_fd = options->metrics_fd;
+    vm->metrics_interval_ms = options->metrics_interval_ms;
+    vm->metrics_stop = 0;
+    vm->time_limit_ms = options->time_limit_ms;
+    vm->cycle_budget = options->cycle_budget;
+    vm->limit_hit = VM_LIMIT_NONE;
+    vm->deadline_stop = 0;
+    vm->profile_hz = options->profile_hz;
+    vm->profile_fd = options->profile_fd;
+    vm->dirty_format = options->dirty_format;
+    vm->dirty_fd = options->dirty_fd;
+    vm->dirty_manual = 0;
+    vm->packed_path = options->packed_path;
+    vm->resumed = 0;
+    memset(&vm->uart, 0, sizeof(vm->uart));
+    vm->uart.irq_fd = -1;
+    vm->uart.stop_fd = -1;
+    pthread_cond_init(&vm->uart.cond, NULL);
+    memset(&vm->output, 0, sizeof(vm->output));
+    vm->output.doorbell_fd = -1;
+    memset(&vm->queue, 0, sizeof(vm->queue));
+    vm->queue.doorbell_fd = -1;
+    vm->queue.irq_fd = -1;
+    memset(&vm->lazy, 0, sizeof(vm->lazy));
+    vm->lazy.fd = -1;
+    memset(&vm->input_log, 0, sizeof(vm->input_log));
+    vm->input_log.fd = -1;
+    vm->lazy.stop_fd = -1;
+    vm->lazy.image_fd = -1;
+    pthread_mutex_init(&vm->console_lock, NULL);
+    pthread_mutex_init(&vm->dump_lock, NULL);
+    pthread_mutex_init(&vm->kick_lock, NULL);
+    pthread_mutex_init(&vm->metrics_lock, NULL);
+    pthread_mutex_init(&vm->deadline_lock, NULL);
+
+    // the sampler waits on it with a timeout, which shouldn't jump with the wall clock
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&vm->metrics_cond, &cond_attr);
+    pthread_cond_init(&vm->deadline_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    vm->kvm = open("/dev/kvm", O_RDWR);
+    if (vm->kvm < 0) {
+        perror("open /dev/kvm");
+        goto fail;
+    }
+
+    vm->vm = ioctl(vm->kvm, KVM_CREATE_VM, 0);
+    if (vm->vm < 0) {
+        perror("KVM_CREATE_VM");
+        goto fail;
+    }
+
+    if (options->halt_poll_is_set && vm_set_halt_poll(vm, options->halt_poll_ns) < 0)
+        goto fail;
+
+    if (options->dirty_format != VM_DIRTY_NONE && vm_enable_manual_dirty_log(vm) < 0)
+        goto fail;
+
+    // KVM wants the irqchip before any vCPU
+    if (options->irqchip && vm_setup_irqchip(vm) < 0)
+        goto fail;
+
+    if (options->input_log_fd >= 0 && input_log_setup(&vm->input_log, options) < 0)
+        goto fail;
+
+    const size_t mem_size = vm_aligned_mem_size(options);
+    vm->mem = vm_alloc_mem(NULL, mem_size, options);
+    if (vm->mem == MAP_FAILED)
+        goto fail;
+    vm->mem_size = mem_size;
+
+    if (vm_bind_mem(vm, options) < 0)
+        goto fail;
+
+    if (options->mem_prefault)
+        vm_prefault_mem(vm, options);
+
+    if (options->output_ring_size && vm_setup_output_ring(vm, options) < 0)
+        goto fail;
+
+    if (options->queue_size && vm_setup_queue(vm, options) < 0)
+        goto fail;
+
+    int max_cpus = ioctl(vm->kvm, KVM_CHECK_EXTENSION, KVM_CAP_MAX_VCPUS);
+    if (max_cpus > 0 && options->cpu_count > (size_t)max_cpus) {
+        fprintf(stderr, "Too many vCPUs, KVM supports up to %d\n", max_cpus);
+        goto fail;
+    }
+
+    vm->cpus = calloc(options->cpu_count, sizeof(struct vm_cpu));
+    if (!vm->cpus) {
+        perror("malloc");
+        goto fail;
+    }
+
+    vm->cpu_count = options->cpu_count;
+    for (size_t i = 0; i < vm->cpu_count; ++i) {
+        vm->cpus[i].vm = vm;
+        vm->cpus[i].id = i;
+        vm->cpus[i].fd = -1;
+        vm->cpus[i].host_cpu = options->host_cpu_count ? options->host_cpus[i % options->host_cpu_count] : -1;
+        vm->cpus[i].run = MAP_FAILED;
+    }
+
+    int run_size = ioctl(vm->kvm, KVM_GET_VCPU_MMAP_SIZE, 0);
+    if (run_size < 0) {
+        perror("KVM_GET_VCPU_MMAP_SIZE");
+        goto fail;
+    }
+    vm->run_size = run_size;
+
+    // only the general purpose registers, segments would cost KVM a VMREAD each on every exit
+    if (ioctl(vm->kvm, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS) & KVM_SYNC_X86_REGS)
+        vm->sync_regs = KVM_SYNC_X86_REGS;
+
+    for (size_t i = 0; i < vm->cpu_count; ++i) {
+        struct vm_cpu *cpu = &vm->cpus[i];
+
+        cpu->fd = ioctl(vm->vm, KVM_CREATE_VCPU, i);
+        if (cpu->fd < 0) {
+            perror("KVM_CREATE_VCPU");
+            goto fail;
+        }
+
+        cpu->run = mmap(NULL, run_size, PROT_READ | PROT_WRITE, MAP_SHARED, cpu->fd, 0);
+        if (cpu->run == MAP_FAILED) {
+            perror("mmap run");
+            goto fail;
+        }
+        cpu->run->kvm_valid_regs = vm->sync_regs;
+    }
+
+    vm_setup_console(vm);
+
+    if (vm->metrics_fd >= 0 && vm_open_kvm_stats(vm) < 0)
+        goto fail;
+
+    return vm;
+
+fail:
+    vm_free(vm);
+    return NULL;
+}
+
+// Maps the image copy-on-write over the start of guest memory, so only touched pages are read.
+static int vm_map_image(struct vm_state *vm, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("stat image");
+        return -1;
+    }
+
+    size_t image_size = bytes_to_pages(st.st_size) * PAGE_SIZE;
+    if (image_size > vm->mem_size)
+        image_size = vm->mem_size;
+    if (image_size == 0)
+        return 0;
+
+    if (mmap(vm->mem, image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("mmap image");
+        return -1;
+    }
+
+    vm->image_size = image_size;
+    return 0;
+}
+
+// Returns the image's copy in the cache directory, making it on first use. The copy is named
+// after the image's device, inode, size and mtime, so a rebuilt image gets a new one.
+static int image_cache_open(int fd, const char *dir) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("stat image");
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Image cache needs a regular image file\n");
+        return -1;
+    }
+
+    char path[PATH_MAX], tmp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/blankvm-%llx-%llx-%llx-%llx.img", dir, (unsigned long long)st.st_dev,
+        (unsigned long long)st.st_ino, (unsigned long long)st.st_size,
+        (unsigned long long)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec);
+    snprintf(tmp, sizeof(tmp), "%s/.blankvm-XXXXXX", dir);
+
+    int cache = open(path, O_RDONLY | O_CLOEXEC);
+    if (cache >= 0 || errno != ENOENT) {
+        if (cache < 0)
+            perror("open image cache");
+        return cache;
+    }
+
+    // copied under a temporary name and linked, so no VM maps a partial copy
+    int out = mkstemp(tmp);
+    if (out < 0) {
+        perror("create image cache");
+        return -1;
+    }
+
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        ssize_t r = sendfile(out, fd, &offset, st.st_size - offset);
+        if (r <= 0) {
+            perror("copy image cache");
+            goto fail;
+        }
+    }
+
+    if (fchmod(out, 0444) < 0) {
+        perror("chmod image cache");
+        goto fail;
+    }
+
+    // another VM may have linked its copy first, then that one is used
+    if (link(tmp, path) < 0 && errno != EEXIST) {
+        perror("link image cache");
+        goto fail;
+    }
+
+    unlink(tmp);
+    close(out);
+
+    cache = open(path, O_RDONLY | O_CLOEXEC);
+    if (cache < 0)
+        perror("open image cache");
+    return cache;
+
+fail:
+    unlink(tmp);
+    close(out);
+    return -1;
+}
+
+// Reads the header, vCPU state and index of a packed image. Returns 0 if the file
+// isn't one, 1 if it is and vm->packed has taken over fd.
+static int vm_open_packed(struct vm_state *vm, int fd) {
+    struct packed_header header;
+    // pipes and files shorter than the header can't be packed images either
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, PACKED_MAGIC, 8) != 0)
+        return 0;
+
+    if (header.version != PACKED_VERSION || header.chunk_size == 0 || header.chunk_size % PAGE_SIZE != 0 ||
+            header.chunk_size > (1ull << 30) || header.extent_count > VM_MAX_REGIONS ||
+            header.msr_count > SNAPSHOT_MSR_COUNT) {
+        fprintf(stderr, "Bad packed image header\n");
+        return -1;
+    }
+
+    struct packed_image *image = calloc(1, sizeof(struct packed_image));
+    if (!image) {
+        perror("malloc");
+        return -1;
+    }
+    image->fd = -1;
+    image->header = header;
+
+    struct packed_cpu cpu;
+    off_t pos = sizeof(header);
+    image->cpu.msrs = calloc(1, sizeof(struct kvm_msrs) + header.msr_count * sizeof(struct kvm_msr_entry));
+    image->extents = calloc(header.extent_count ? header.extent_count : 1, sizeof(struct packed_extent));
+    image->chunks = calloc(header.chunk_count ? header.chunk_count : 1, sizeof(struct packed_chunk));
+    if (!image->cpu.msrs || !image->extents || !image->chunks) {
+        perror("malloc");
+        goto fail;
+    }
+
+    image->cpu.msrs->nmsrs = header.msr_count;
+    const size_t msrs_size = header.msr_count * sizeof(struct kvm_msr_entry);
+    const size_t extents_size = header.extent_count * sizeof(struct packed_extent);
+    if (pread_full(fd, &cpu, sizeof(cpu), pos) < 0 ||
+            pread_full(fd, image->cpu.msrs->entries, msrs_size, pos + sizeof(cpu)) < 0 ||
+            pread_full(fd, image->extents, extents_size, pos + sizeof(cpu) + msrs_size) < 0 ||
+            pread_full(fd, image->chunks, header.chunk_count * sizeof(struct packed_chunk),
+                pos + sizeof(cpu) + msrs_size + extents_size) < 0) {
+        fprintf(stderr, "Packed image is truncated\n");
+        goto fail;
+    }
+    image->cpu.regs = cpu.regs;
+    image->cpu.sregs = cpu.sregs;
+    image->cpu.fpu = cpu.fpu;
+    image->cpu.events = cpu.events;
+    image->cpu.xcrs = cpu.xcrs;
+    image->cpu.xsave = cpu.xsave;
+
+    uint64_t chunks = 0, loaded = 0;
+    for (size_t i = 0; i < header.extent_count; ++i) {
+        const struct packed_extent *extent = &image->extents[i];
+        if (extent->guest_addr + extent->size < extent->guest_addr) {
+            fprintf(stderr, "Bad packed image extent\n");
+            goto fail;
+        }
+        chunks += (extent->size + header.chunk_size - 1) / header.chunk_size;
+
+        // the rest (the page table) is checked against the slots when it is unpacked
+        if (extent->guest_addr >= vm->mem_size)
+            continue;
+        if (extent->guest_addr + extent->size > vm->mem_size) {
+            fprintf(stderr, "Packed image needs more guest memory\n");
+            goto fail;
+        }
+        if (extent->guest_addr + extent->size > loaded)
+            loaded = extent->guest_addr + extent->size;
+    }
+
+    if (chunks != header.chunk_count) {
+        fprintf(stderr, "Bad packed image index\n");
+        goto fail;
+    }
+
+    packed_image_free(vm->packed);
+    image->fd = fd;
+    vm->packed = image;
+    vm->image_loaded = loaded;
+    return 1;
+
+fail:
+    packed_image_free(image);
+    return -1;
+}
+
+static int vm_load_image(struct vm_state *vm, const char *path, const struct vm_options *options) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open image");
+        goto fail;
+    }
+
+    int packed = vm_open_packed(vm, fd);
+    if (packed < 0)
+        goto fail;
+    if (packed) {
+        if (options->zero_copy || options->lazy_mem) {
+            fprintf(stderr, "Packed image can't be mapped, it is unpacked at boot\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (options->image_cache) {
+        int cache = image_cache_open(fd, options->image_cache);
+        close(fd);
+        fd = cache;
+        if (fd < 0 || vm_map_image(vm, fd) < 0)
+            goto fail;
+    } else if (options->zero_copy) {
+        if (vm_map_image(vm, fd) < 0)
+            goto fail;
+    } else if (options->lazy_mem) {
+        // read by the lazy thread as the guest touches it
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            perror("stat image");
+            goto fail;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            fprintf(stderr, "Lazy memory needs a regular image file\n");
+            goto fail;
+        }
+
+        if (vm->lazy.image_fd >= 0)
+            close(vm->lazy.image_fd);
+        vm->lazy.image_fd = fd;
+        vm->image_loaded = (size_t)st.st_size < vm->mem_size ? (size_t)st.st_size : vm->mem_size;
+        return 0;
+    } else {
+        ssize_t r = read(fd, vm->mem, vm->mem_size);
+        if (r < 0) {
+            perror("read image");
+            goto fail;
+        }
+        vm->image_loaded = r;
+    }
+
+    close(fd);
+    return 0;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+
+    return -1;
+}
+
+#define PT_LEVELS 4
+#define PT_ENTRIES 512
+
+struct pt_builder {
+    uint64_t *tables;   // NULL when only counting tables
+    uint64_t guest_base;
+    size_t tables_used;
+    size_t leaf_level;  // highest level allowed to map a page: 0 = 4K, 1 = 2M, 2 = 1G
+};
+
+static size_t pt_level_span(size_t level) {
+    return PAGE_SIZE << (9 * level);
+}
+
+// Fills a new table at the given level to map [base, base + size), returns its index.
+static size_t pt_build(struct pt_builder *b, size_t level, uint64_t base, uint64_t size) {
+    const size_t table = b->tables_used++;
+    const uint64_t span = pt_level_span(level);
+    uint64_t *pt = b->tables ? b->tables + table * PT_ENTRIES : NULL;
+
+    size_t i = 0;
+    if (level == 0 || level <= b->leaf_level) {
+        const uint64_t flags = level == 0 ? 0x03 : 0x83; // present + writable (+ PS for large pages)
+        for (; (i + 1) * span <= size; ++i) {
+            if (pt)
+                pt[i] = base + i * span + flags;
+        }
+    }
+
+    for (; i * span < size; ++i) {
+        uint64_t addr = base + i * span;
+        uint64_t left = size - i * span;
+        if (level == 0) {
+            // partial page at the end of memory
+            if (pt)
+                pt[i] = addr + 0x03;
+            continue;
+        }
+        size_t child = pt_build(b, level - 1, addr, left < span ? left : span);
+        if (pt)
+            pt[i] = b->guest_base + child * PAGE_SIZE + 0x03;
+    }
+
+    return table;
+}
+
+#define CPUID_FEATURES 1
+#define CPUID_FEATURES_ECX_XSAVE (1u << 26)
+#define CPUID_TOPOLOGY 0xB
+#define CPUID_XSAVE 0xD
+#define CPUID_TOPOLOGY_V2 0x1F
+#define XCR0_GUEST_STATE 0xE7 // x87, SSE, AVX, opmask, ZMM_Hi256, Hi16_ZMM
+#define CPUID_EXT_MAX 0x80000000
+#define CPUID_EXT_FEATURES 0x80000001
+#define CPUID_EXT_FEATURES_EDX_GBPAGES (1u << 26)
+#define CPUID_EXT_ADDR_SIZES 0x80000008
+// hypervisor timing leaf: TSC and LAPIC bus frequencies in kHz
+#define CPUID_HV_TIMING 0x40000010
+#define LAPIC_BUS_KHZ 1000000
+#define KVM_CLOCK_FEATURES ((1u << KVM_FEATURE_CLOCKSOURCE) | (1u << KVM_FEATURE_CLOCKSOURCE2) | \
+    (1u << KVM_FEATURE_CLOCKSOURCE_STABLE_BIT))
+
+static struct kvm_cpuid2 *vm_get_supported_cpuid(struct vm_state *vm) {
+    if (vm->supported_cpuid)
+        return vm->supported_cpuid;
+
+    for (size_t nent = 64; ; nent *= 2) {
+        struct kvm_cpuid2 *cpuid = calloc(1, sizeof(struct kvm_cpuid2) + nent * sizeof(struct kvm_cpuid_entry2));
+        if (!cpuid) {
+            perror("malloc");
+            return NULL;
+        }
+
+        cpuid->nent = nent;
+        if (ioctl(vm->kvm, KVM_GET_SUPPORTED_CPUID, cpuid) == 0) {
+            vm->supported_cpuid = cpuid;
+            return cpuid;
+        }
+
+        int err = errno;
+        free(cpuid);
+        if (err != E2BIG || nent >= 4096) {
+            errno = err;
+            perror("KVM_GET_SUPPORTED_CPUID");
+            return NULL;
+        }
+    }
+}
+
+static struct kvm_cpuid_entry2 *cpuid_find(struct kvm_cpuid2 *cpuid, uint32_t function, uint32_t index) {
+    for (size_t i = 0; i < cpuid->nent; ++i) {
+        struct kvm_cpuid_entry2 *entry = &cpuid->entries[i];
+        if (entry->function != function)
+            continue;
+        if ((entry->flags & KVM_CPUID_FLAG_SIGNIFCANT_INDEX) && entry->index != index)
+            continue;
+        return entry;
+    }
+    return NULL;
+}
+
+static int vm_supports_gbpages(struct vm_state *vm) {
+    struct kvm_cpuid2 *supported = vm_get_supported_cpuid(vm);
+    if (!supported)
+        return 0;
+
+    struct kvm_cpuid_entry2 *entry = cpuid_find(supported, CPUID_EXT_FEATURES, 0);
+    return entry && (entry->edx & CPUID_EXT_FEATURES_EDX_GBPAGES);
+}
+
+static int vm_fill_page_table(struct vm_state *vm, const struct vm_options *options, uint64_t *cr3) {
+    size_t page_size = options->pt_page_size;
+    if (page_size == 0)
+        page_size = vm_supports_gbpages(vm) ? pt_level_span(2) : pt_level_span(1);
+
+    // files are mapped too, the table goes after the highest of them
+    uint64_t mapped_size = vm->mem_size;
+    for (size_t i = 0; i < vm->region_count; ++i) {
+        if (vm->regions[i].guest_addr + vm->regions[i].size > mapped_size)
+            mapped_size = vm->regions[i].guest_addr + vm->regions[i].size;
+    }
+
+    struct pt_builder builder = {
+        .tables = NULL,
+        .guest_base = bytes_to_pages(mapped_size) * PAGE_SIZE,
+    };
+
+    while (pt_level_span(builder.leaf_level) < page_size)
+        ++builder.leaf_level;
+
+    if (builder.leaf_level == 2 && !vm_supports_gbpages(vm)) {
+        fprintf(stderr, "1G pages are not supported\n");
+        goto fail;
+    }
+
+    pt_build(&builder, PT_LEVELS - 1, 0, mapped_size);
+
+    vm->page_table_size = builder.tables_used * PAGE_SIZE;
+    vm->page_table = mmap(NULL, vm->page_table_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (vm->page_table == MAP_FAILED) {
+        perror("mmap page table");
+        goto fail;
+    }
+
+    // fresh mapping is already zeroed, only used entries are written
+    builder.tables = vm->page_table;
+    builder.tables_used = 0;
+    pt_build(&builder, PT_LEVELS - 1, 0, mapped_size);
+
+    if (vm_add_region(vm, builder.guest_base, vm->page_table_size, vm->page_table, vm_region_flags(options),
+            "page table") < 0)
+        goto fail;
+
+    // top level table is built first
+    *cr3 = builder.guest_base;
+    return 0;
+
+fail:
+    return -1;
+}
+
+// Returns the entry for function (index 0), appending an empty one if there is none yet.
+// cpuid must have room for it.
+static struct kvm_cpuid_entry2 *cpuid_set(struct kvm_cpuid2 *cpuid, uint32_t function) {
+    struct kvm_cpuid_entry2 *entry = cpuid_find(cpuid, function, 0);
+    if (entry)
+        return entry;
+
+    entry = &cpuid->entries[cpuid->nent++];
+    memset(entry, 0, sizeof(*entry));
+    entry->function = function;
+    return entry;
+}
+
+// With -C the guest sees every leaf KVM can virtualize on this host, otherwise only what
+// the page table needs. APIC IDs in the host leaves are fixed up per vCPU.
+static int vm_setup_cpuid(struct vm_state *vm, const struct vm_options *options) {
+    struct kvm_cpuid2 *supported = vm_get_supported_cpuid(vm);
+    if (!supported)
+        return -1;
+
+    const size_t room = (options->cpu_host ? supported->nent : 0) + 6;
+    struct kvm_cpuid2 *cpuid = calloc(1, sizeof(struct kvm_cpuid2) + room * sizeof(struct kvm_cpuid_entry2));
+    if (!cpuid) {
+        perror("malloc");
+        return -1;
+    }
+
+    const int tsc_khz = ioctl(vm->cpus[0].fd, KVM_GET_TSC_KHZ, 0);
+    vm->tsc_khz = tsc_khz > 0 ? tsc_khz : 0;
+
+    struct kvm_cpuid_entry2 *kvm_features = cpuid_find(supported, KVM_CPUID_FEATURES, 0);
+    const uint32_t kvm_feature_bits = kvm_features ? kvm_features->eax : 0;
+
+    if (options->cpu_host) {
+        memcpy(cpuid->entries, supported->entries, supported->nent * sizeof(struct kvm_cpuid_entry2));
+        cpuid->nent = supported->nent;
+    } else {
+        // Without CPUID KVM assumes 36-bit physical addresses and treats the PS bit in PDPTEs
+        // as reserved when it walks guest page tables itself (e.g. emulating string I/O).
+        // Advertise just enough to cover the generated mapping.
+        cpuid_set(cpuid, CPUID_EXT_MAX)->eax = CPUID_EXT_ADDR_SIZES;
+        cpuid_set(cpuid, CPUID_EXT_FEATURES)->edx = vm_supports_gbpages(vm) ? CPUID_EXT_FEATURES_EDX_GBPAGES : 0;
+
+        struct kvm_cpuid_entry2 *addr_sizes = cpuid_find(supported, CPUID_EXT_ADDR_SIZES, 0);
+        cpuid_set(cpuid, CPUID_EXT_ADDR_SIZES)->eax = addr_sizes ? addr_sizes->eax & 0xFFFF : 0;
+    }
+
+    // kvmclock: the guest writes a page address to MSR_KVM_SYSTEM_TIME_NEW and KVM keeps
+    // the pvclock data there up to date, reading the time takes no exit
+    struct kvm_cpuid_entry2 *signature = cpuid_set(cpuid, KVM_CPUID_SIGNATURE);
+    signature->eax = CPUID_HV_TIMING;
+    memcpy(&signature->ebx, "KVMK", 4);
+    memcpy(&signature->ecx, "VMKV", 4);
+    memcpy(&signature->edx, "M\0\0\0", 4);
+
+    cpuid_set(cpuid, KVM_CPUID_FEATURES)->eax = options->cpu_host ? kvm_feature_bits : kvm_feature_bits & KVM_CLOCK_FEATURES;
+    struct kvm_cpuid_entry2 *timing = cpuid_set(cpuid, CPUID_HV_TIMING);
+    timing->eax = vm->tsc_khz;
+    timing->ebx = LAPIC_BUS_KHZ;
+
+    int r = 0;
+    for (size_t i = 0; i < vm->cpu_count && r == 0; ++i) {
+        for (size_t e = 0; options->cpu_host && e < cpuid->nent; ++e) {
+            struct kvm_cpuid_entry2 *entry = &cpuid->entries[e];
+            if (entry->function == CPUID_FEATURES)
+                entry->ebx = (entry->ebx & 0x00FFFFFF) | (uint32_t)i << 24;
+            else if (entry->function == CPUID_TOPOLOGY || entry->function == CPUID_TOPOLOGY_V2)
+                entry->edx = i;
+        }
+
+        r = ioctl(vm->cpus[i].fd, KVM_SET_CPUID2, cpuid);
+        if (r < 0)
+            perror("KVM_SET_CPUID2");
+    }
+
+    free(cpuid);
+    return r;
+}
+
+// x87, SSE, AVX and AVX-512 state, as far as KVM supports them
+static uint64_t vm_supported_xcr0(struct vm_state *vm) {
+    struct kvm_cpuid_entry2 *features = cpuid_find(vm->supported_cpuid, CPUID_FEATURES, 0);
+    struct kvm_cpuid_entry2 *xsave = cpuid_find(vm->supported_cpuid, CPUID_XSAVE, 0);
+    if (!features || !(features->ecx & CPUID_FEATURES_ECX_XSAVE) || !xsave)
+        return 0;
+
+    return (xsave->eax | (uint64_t)xsave->edx << 32) & XCR0_GUEST_STATE;
+}
+
+// After KVM_RUN the registers are in the kvm_run page if KVM syncs them, else they are fetched when needed.
+static void vm_cpu_exited(struct vm_cpu *cpu) {
+    cpu->regs_view = cpu->vm->sync_regs & KVM_SYNC_X86_REGS ? &cpu->run->s.regs.regs : NULL;
+    cpu->sregs_view = NULL;
+}
+
+// KVM_SET_REGS and KVM_SET_SREGS leave the view behind.
+static void vm_cpu_drop_regs(struct vm_cpu *cpu) {
+    cpu->regs_view = NULL;
+    cpu->sregs_view = NULL;
+}
+
+// Registers as of the last exit, valid until the next KVM_RUN. Costs at most one ioctl per exit,
+// none with KVM_CAP_SYNC_REGS. Only the vCPU's own thread may use it.
+static struct kvm_regs *vm_cpu_regs(struct vm_cpu *cpu) {
+    if (!cpu->regs_view) {
+        if (ioctl(cpu->fd, KVM_GET_REGS, &cpu->regs) < 0) {
+            perror("KVM_GET_REGS");
+            return NULL;
+        }
+        cpu->regs_view = &cpu->regs;
+    }
+    return cpu->regs_view;
+}
+
+static struct kvm_sregs *vm_cpu_sregs(struct vm_cpu *cpu) {
+    if (!cpu->sregs_view) {
+        if (ioctl(cpu->fd, KVM_GET_SREGS, &cpu->sregs) < 0) {
+            perror("KVM_GET_SREGS");
+            return NULL;
+        }
+        cpu->sregs_view = &cpu->sregs;
+    }
+    return cpu->sregs_view;
+}
+
+static void vm_setup_segment(struct kvm_segment *seg, enum vm_mode mode, int is_code) {
+    seg->base = 0;
+    seg->selector = mode == VM_MODE_REAL ? 0 : (is_code ? 8 : 16);
+    seg->limit = mode == VM_MODE_REAL ? 0xFFFF : 0xFFFFFFFF;
+    seg->type = is_code ? 0x0B : 0x03;
+    seg->db = mode == VM_MODE_PROTECTED ? 1 : 0;
+    seg->l = mode == VM_MODE_LONG ? 1 : 0;
+    seg->g = mode == VM_MODE_REAL ? 0 : 1;
+}
+
+static int vm_cpu_prepare_to_boot(struct vm_cpu *cpu, const struct vm_options *options, uint64_t cr3) {
+    const struct kvm_regs *current_regs = vm_cpu_regs(cpu);
+    const struct kvm_sregs *current_sregs = vm_cpu_sregs(cpu);
+    if (!current_regs || !current_sregs)
+        goto fail;
+
+    struct kvm_regs regs = *current_regs;
+    struct kvm_sregs sregs = *current_sregs;
+    vm_cpu_drop_regs(cpu);
+
+    switch (options->mode) {
+    case VM_MODE_REAL:
+        break;
+    case VM_MODE_PROTECTED:
+        sregs.cr0 |= 0x00000001; // PE
+        break;
+    case VM_MODE_LONG:
+        sregs.cr3 = cr3;
+        sregs.cr0 |= 0x80000001; // PG, PE
+        sregs.cr4 |= 0x00000020; // PAE
+        sregs.efer |= 0x00000500; // LMA, LME
+        break;
+    }
+
+    // with the in-kernel LAPIC all but the first vCPU would wait for a startup IPI
+    if (cpu->vm->irqchip) {
+        struct kvm_mp_state mp_state = {
+            .mp_state = KVM_MP_STATE_RUNNABLE
+        };
+
+        if (ioctl(cpu->fd, KVM_SET_MP_STATE, &mp_state) < 0) {
+            perror("KVM_SET_MP_STATE");
+            goto fail;
+        }
+    }
+
+    regs.rip = options->entry_point;
+    // every vCPU starts at the entry point and tells itself apart by its index
+    regs.rdi = cpu->id;
+    regs.rsi = cpu->vm->cpu_count;
+    regs.rdx = cpu->vm->tsc_khz;
+    // so the guest needn't hardcode where -o put the ring
+    regs.rcx = options->output_ring_size ? options->output_ring_addr : 0;
+    regs.r8 = options->output_ring_size;
+
+    vm_setup_segment(&sregs.cs, options->mode, 1);
+    vm_setup_segment(&sregs.ds, options->mode, 0);
+    vm_setup_segment(&sregs.es, options->mode, 0);
+    vm_setup_segment(&sregs.fs, options->mode, 0);
+    vm_setup_segment(&sregs.gs, options->mode, 0);
+    vm_setup_segment(&sregs.ss, options->mode, 0);
+
+    // with -C SSE works right away, AVX too when XSAVE is there
+    const uint64_t xcr0 = options->cpu_host && options->mode != VM_MODE_REAL ? vm_supported_xcr0(cpu->vm) : 0;
+    if (options->cpu_host && options->mode != VM_MODE_REAL) {
+        sregs.cr0 = (sregs.cr0 & ~0x00000004ull) | 0x00000022; // clear EM, set MP, NE
+        sregs.cr4 |= 0x00000600; // OSFXSR, OSXMMEXCPT
+        if (xcr0)
+            sregs.cr4 |= 0x00040000; // OSXSAVE
+    }
+
+    if (ioctl(cpu->fd, KVM_SET_REGS, &regs) < 0) {
+        perror("KVM_SET_REGS");
+        goto fail;
+    }
+
+    if (ioctl(cpu->fd, KVM_SET_SREGS, &sregs) < 0) {
+        perror("KVM_SET_SREGS");
+        goto fail;
+    }
+
+    if (xcr0) {
+        struct kvm_xcrs xcrs = {
+            .nr_xcrs = 1,
+            .xcrs = { { .xcr = 0, .value = xcr0 } }
+        };
+
+        if (ioctl(cpu->fd, KVM_SET_XCRS, &xcrs) < 0) {
+            perror("KVM_SET_XCRS");
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    return -1;
+}
+
+static int vm_prepare_to_boot(struct vm_state *vm, const struct vm_options *options) {
+    uint64_t cr3 = 0;
+
+    switch (options->mode) {
+    case VM_MODE_REAL:
+        if (options->entry_point >= 0x10000) {
+            fprintf(stderr, "Entry point too far for real mode\n");
+            goto fail;
+        }
+        break;
+    case VM_MODE_PROTECTED:
+        if (options->entry_point >= 0x100000000ull) {
+            fprintf(stderr, "Entry point too far for protected mode\n");
+            goto fail;
+        }
+        break;
+    case VM_MODE_LONG:
+        if (options->page_table_is_set) {
+            cr3 = options->page_table;
+        } else {
+            if (vm_fill_page_table(vm, options, &cr3) < 0)
+                goto fail;
+        }
+        break;
+    }
+
+    if (vm_setup_cpuid(vm, options) < 0)
+        goto fail;
+
+    for (size_t i = 0; i < vm->cpu_count; ++i) {
+        if (vm_cpu_prepare_to_boot(&vm->cpus[i], options, cr3) < 0)
+            goto fail;
+    }
+
+    return 0;
+
+fail:
+    return -1;
+}
+
+static void vm_dump_segment(const char* name, const struct kvm_segment *seg) {
+    fprintf(stderr, "%s BASE=%016llx LIM=%08x SEL=%04x ", name, seg->base, seg->limit, seg->selector);
+    fprintf(stderr, "TP=%x P=%x DPL=%x DB=%x S=%x L=%x G=%x A=%x\n",
+        seg->type, seg->present, seg->dpl, seg->db, seg->s, seg->l, seg->g, seg->avl);
+}
+
+static const char *exit_reasons[] = {
+    "KVM_EXIT_UNKNOWN", "KVM_EXIT_EXCEPTION", "KVM_EXIT_IO", "KVM_EXIT_HYPERCALL",
+    "KVM_EXIT_DEBUG", "KVM_EXIT_HLT", "KVM_EXIT_MMIO", "KVM_EXIT_IRQ_WINDOW_OPEN",
+    "KVM_EXIT_SHUTDOWN", "KVM_EXIT_FAIL_ENTRY", "KVM_EXIT_INTR", "KVM_EXIT_SET_TPR",
+    "KVM_EXIT_TPR_ACCESS", "KVM_EXIT_S390_SIEIC", "KVM_EXIT_S390_RESET", "KVM_EXIT_DCR",
+    "KVM_EXIT_NMI", "KVM_EXIT_INTERNAL_ERROR", "KVM_EXIT_OSI", "KVM_EXIT_PAPR_HCALL",
+    "KVM_EXIT_S390_UCONTROL", "KVM_EXIT_WATCHDOG", "KVM_EXIT_S390_TSCH", "KVM_EXIT_EPR",
+    "KVM_EXIT_SYSTEM_EVENT", "KVM_EXIT_S390_STSI", "KVM_EXIT_IOAPIC_EOI", "KVM_EXIT_HYPERV"
+};
+
+static const char *exit_reason_name(uint32_t exit_reason) {
+    return exit_reason < sizeof(exit_reasons)/sizeof(*exit_reasons) ? exit_reasons[exit_reason] : "UNKNOWN";
+}
+
+static void vm_dump(struct vm_cpu *cpu) {
+    const struct kvm_run *run = cpu->run;
+
+    fprintf(stderr, "===== BEGIN VM STATE =====\n");
+    if (cpu->vm->cpu_count > 1)
+        fprintf(stderr, "vCPU: %d\n", cpu->id);
+
+    const uint32_t exit_reason = run->exit_reason;
+    fprintf(stderr, "Exit reason: %u (%s)\n\n", exit_reason, exit_reason_name(exit_reason));
+
+    if (exit_reason == KVM_EXIT_IO) {
+        if (run->io.direction == KVM_EXIT_IO_OUT) {
+            fprintf(stderr, "Write %ux%u bytes at port %04x: ",
+                run->io.count, run->io.size, run->io.port);
+            for (size_t i = 0; i < run->io.count * run->io.size; ++i)
+                fprintf(stderr, "%02x ", ((const uint8_t*)run)[run->io.data_offset + i]);
+            fprintf(stderr, "\n\n");
+        } else {
+            fprintf(stderr, "Read %ux%u bytes at port %04x\n\n",
+                run->io.count, run->io.size, run->io.port);
+        }
+    } else if (exit_reason == KVM_EXIT_MMIO) {
+        if (run->mmio.is_write) {
+            fprintf(stderr, "Write %u bytes at %016llx: ",
+                run->mmio.len, run->mmio.phys_addr);
+            for (size_t i = 0; i < run->mmio.len; ++i)
+                fprintf(stderr, "%02x ", run->mmio.data[i]);
+            fprintf(stderr, "\n\n");
+        } else {
+            fprintf(stderr, "Read %u bytes at %016llx\n\n",
+                run->mmio.len, run->mmio.phys_addr);
+        }
+    }
+
+    const struct kvm_regs *regs_view = vm_cpu_regs(cpu);
+    if (regs_view) {
+        const struct kvm_regs regs = *regs_view;
+        fprintf(stderr, "RAX=%016llx RBX=%016llx RCX=%016llx RDX=%016llx\n", regs.rax, regs.rbx, regs.rcx, regs.rdx);
+        fprintf(stderr, "RSI=%016llx RDI=%016llx RSP=%016llx RBP=%016llx\n", regs.rsi, regs.rdi, regs.rsp, regs.rbp);
+        fprintf(stderr, "R8 =%016llx R9 =%016llx R10=%016llx R11=%016llx\n", regs.r8,  regs.r9,  regs.r10, regs.r11);
+        fprintf(stderr, "R12=%016llx R13=%016llx R14=%016llx R15=%016llx\n", regs.r12, regs.r13, regs.r14, regs.r15);
+        fprintf(stderr, "RIP=%016llx RFL=%016llx\n\n", regs.rip, regs.rflags);
+    }
+
+    const struct kvm_sregs *sregs_view = vm_cpu_sregs(cpu);
+    if (sregs_view) {
+        const struct kvm_sregs sregs = *sregs_view;
+
+        vm_dump_segment("CS ", &sregs.cs);
+        vm_dump_segment("DS ", &sregs.ds);
+        vm_dump_segment("ES ", &sregs.es);
+        vm_dump_segment("FS ", &sregs.fs);
+        vm_dump_segment("GS ", &sregs.gs);
+        vm_dump_segment("SS ", &sregs.ss);
+        vm_dump_segment("TR ", &sregs.tr);
+        vm_dump_segment("LDT", &sregs.ldt);
+        fprintf(stderr, "GDT BASE=%016llx LIM=%04x        ", sregs.gdt.base, sregs.gdt.limit);
+        fprintf(stderr, "IDT BASE=%016llx LIM=%04x\n\n", sregs.idt.base, sregs.idt.limit);
+
+        fprintf(stderr, "CR0=%016llx CR2=%016llx CR3=%016llx CR4=%016llx\n", sregs.cr0, sregs.cr2, sregs.cr3, sregs.cr4);
+        fprintf(stderr, "CR8=%016llx EFER=%016llx APIC=%016llx\n", sregs.cr8, sregs.efer, sregs.apic_base);
+        fprintf(stderr, "INT BITMAP %016llx %016llx %016llx %016llx\n",
+            sregs.interrupt_bitmap[0], sregs.interrupt_bitmap[1], sregs.interrupt_bitmap[2], sregs.interrupt_bitmap[3]);
+    }
+
+    fprintf(stderr, "===== END VM STATE =====\n\n");
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void stats_hist_add(uint64_t *hist, uint64_t ns) {
+    size_t bucket = 63 - __builtin_clzll(ns | 1);
+    ++hist[bucket < VM_STATS_BUCKETS ? bucket : VM_STATS_BUCKETS - 1];
+}
+
+static void vm_stats_exit(struct vm_stats *stats, const struct kvm_run *run, uint64_t guest_ns) {
+    stats->guest_ns += guest_ns;
+    stats_hist_add(stats->guest_hist, guest_ns);
+    ++stats->exits[run->exit_reason < VM_STATS_REASONS ? run->exit_reason : KVM_EXIT_UNKNOWN];
+
+    uint64_t addr = 0;
+    uint8_t mmio = 0, write = 0;
+    if (run->exit_reason == KVM_EXIT_IO) {
+        addr = run->io.port;
+        write = run->io.direction == KVM_EXIT_IO_OUT;
+    } else if (run->exit_reason == KVM_EXIT_MMIO) {
+        addr = run->mmio.phys_addr;
+        mmio = 1;
+        write = run->mmio.is_write;
+    } else {
+        return;
+    }
+
+    // guests use a handful of ports, a linear search is fine
+    for (size_t i = 0; i < stats->addr_count; ++i) {
+        struct vm_stats_addr *a = &stats->addrs[i];
+        if (a->addr == addr && a->mmio == mmio && a->write == write) {
+            ++a->count;
+            return;
+        }
+    }
+
+    if (stats->addr_count == VM_STATS_ADDRS) {
+        ++stats->other_addrs;
+        return;
+    }
+
+    stats->addrs[stats->addr_count++] = (struct vm_stats_addr){ .addr = addr, .mmio = mmio, .write = write, .count = 1 };
+}
+
+static void vm_stats_handler(struct vm_stats *stats, uint64_t handler_ns) {
+    stats->handler_ns += handler_ns;
+    stats_hist_add(stats->handler_hist, handler_ns);
+}
+
+// Sums the statistics of all vCPUs. Running vCPUs keep counting, so it's only a close estimate then.
+static void vm_stats_sum(const struct vm_state *vm, struct vm_stats *total) {
+    memset(total, 0, sizeof(*total));
+
+    for (size_t i = 0; i < vm->cpu_count; ++i) {
+        const struct vm_stats *stats = &vm->cpus[i].stats;
+
+        for (size_t r = 0; r < VM_STATS_REASONS; ++r)
+            total->exits[r] += stats->exits[r];
+        for (size_t b = 0; b < VM_STATS_BUCKETS; ++b) {
+            total->guest_hist[b] += stats->guest_hist[b];
+            total->handler_hist[b] += stats->handler_hist[b];
+        }
+        total->guest_ns += stats->guest_ns;
+        total->handler_ns += stats->handler_ns;
+        total->other_addrs += stats->other_addrs;
+
+        const size_t addr_count = stats->addr_count < VM_STATS_ADDRS ? stats->addr_count : VM_STATS_ADDRS;
+        for (size_t a = 0; a < addr_count; ++a) {
+            const struct vm_stats_addr *addr = &stats->addrs[a];
+            size_t j = 0;
+            while (j < total->addr_count && (total->addrs[j].addr != addr->addr ||
+                    total->addrs[j].mmio != addr->mmio || total->addrs[j].write != addr->write))
+                ++j;
+
+            if (j < total->addr_count) {
+                total->addrs[j].count += addr->count;
+            } else if (total->addr_count < VM_STATS_ADDRS) {
+                total->addrs[total->addr_count++] = *addr;
+            } else {
+                total->other_addrs += addr->count;
+            }
+        }
+    }
+}
+
+static void stats_print_hist_text(const char *name, uint64_t total_ns, const uint64_t *hist) {
+    fprintf(stderr, "%s: %.3f ms\n", name, total_ns / 1e6);
+    for (size_t b = 0; b < VM_STATS_BUCKETS; ++b) {
+        if (hist[b])
+            fprintf(stderr, "  >= %14llu ns  %12llu\n", 1ull << b, (unsigned long long)hist[b]);
+    }
+}
+
+static void stats_print_hist_json(const char *name, uint64_t total_ns, const uint64_t *hist) {
+    fprintf(stderr, "\"%s\": {\"total\": %llu, \"buckets\": [", name, (unsigned long long)total_ns);
+    const char *sep = "";
+    for (size_t b = 0; b < VM_STATS_BUCKETS; ++b) {
+        if (!hist[b])
+            continue;
+        fprintf(stderr, "%s[%llu, %llu]", sep, 1ull << b, (unsigned long long)hist[b]);
+        sep = ", ";
+    }
+    fprintf(stderr, "]}");
+}
+
+// Host memory behind guest memory, in KiB
+struct vm_mem_usage {
+    uint64_t rss;
+    uint64_t pss;
+    uint64_t shared;
+    uint64_t private;
+    uint64_t anon;
+};
+
+// Sums /proc/self/smaps over the mappings that back memory slots, so it holds for
+// one VM even when the process runs many of them.
+static int vm_mem_usage(const struct vm_state *vm, struct vm_mem_usage *usage) {
+    memset(usage, 0, sizeof(*usage));
+
+    FILE *f = fopen("/proc/self/smaps", "re");
+    if (!f)
+        return -1;
+
+    char line[512];
+    int counted = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long begin, end, value;
+        char name[32];
+        if (sscanf(line, "%llx-%llx ", &begin, &end) == 2) {
+            counted = 0;
+            for (size_t i = 0; i < vm->region_count; ++i) {
+                const uintptr_t host = (uintptr_t)vm->regions[i].host;
+                if (begin >= host && end <= host + vm->regions[i].size)
+                    counted = 1;
+            }
+        } else if (counted && sscanf(line, "%31[^:]: %llu kB", name, &value) == 2) {
+            if (strcmp(name, "Rss") == 0)
+                usage->rss += value;
+            else if (strcmp(name, "Pss") == 0)
+                usage->pss += value;
+            else if (strcmp(name, "Shared_Clean") == 0 || strcmp(name, "Shared_Dirty") == 0)
+                usage->shared += value;
+            else if (strcmp(name, "Private_Clean") == 0 || strcmp(name, "Private_Dirty") == 0)
+                usage->private += value;
+            else if (strcmp(name, "Anonymous") == 0)
+                usage->anon += value;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+// Prints exit counts and time histograms to stderr. Histogram buckets are
+// identified by their lower bound in ns.
+static void vm_stats_report(const struct vm_state *vm) {
+    if (vm->stats_format == VM_STATS_NONE)
+        return;
+
+    struct vm_stats total;
+    vm_stats_sum(vm, &total);
+
+    uint64_t exits = 0;
+    for (size_t r = 0; r < VM_STATS_REASONS; ++r)
+        exits += total.exits[r];
+
+    struct vm_mem_usage mem;
+    const int mem_ok = vm_mem_usage(vm, &mem) == 0;
+
+    if (vm->stats_format == VM_STATS_TEXT) {
+        fprintf(stderr, "===== BEGIN EXIT STATS =====\n");
+        fprintf(stderr, "Exits: %llu\n", (unsigned long long)exits);
+        for (size_t r = 0; r < VM_STATS_REASONS; ++r) {
+            if (total.exits[r])
+                fprintf(stderr, "  %-24s %12llu\n", exit_reason_name(r), (unsigned long long)total.exits[r]);
+        }
+
+        fprintf(stderr, "\nAddresses:\n");
+        for (size_t a = 0; a < total.addr_count; ++a) {
+            const struct vm_stats_addr *addr = &total.addrs[a];
+            fprintf(stderr, addr->mmio ? "  mmio %016llx %-5s %12llu\n" : "  port %04llx %-5s %12llu\n",
+                (unsigned long long)addr->addr, addr->write ? "write" : "read", (unsigned long long)addr->count);
+        }
+        if (total.other_addrs)
+            fprintf(stderr, "  other %12llu\n", (unsigned long long)total.other_addrs);
+
+        fprintf(stderr, "\n");
+        stats_print_hist_text("Time in guest", total.guest_ns, total.guest_hist);
+        stats_print_hist_text("Time in exit handlers", total.handler_ns, total.handler_hist);
+        if (mem_ok) {
+            fprintf(stderr, "\nGuest memory on host: rss %llu KiB, pss %llu KiB, shared %llu KiB, private %llu KiB, anon %llu KiB\n",
+                (unsigned long long)mem.rss, (unsigned long long)mem.pss, (unsigned long long)mem.shared,
+                (unsigned long long)mem.private, (unsigned long long)mem.anon);
+        }
+        if (vm->lazy.fd >= 0) {
+            fprintf(stderr, "Lazy memory: %llu faults, %llu pages filled\n",
+                (unsigned long long)__atomic_load_n(&vm->lazy.faults, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&vm->lazy.pages, __ATOMIC_RELAXED));
+        }
+        fprintf(stderr, "===== END EXIT STATS =====\n\n");
+        return;
+    }
+
+    fprintf(stderr, "{\"exits\": {");
+    const char *sep = "";
+    for (size_t r = 0; r < VM_STATS_REASONS; ++r) {
+        if (!total.exits[r])
+            continue;
+        fprintf(stderr, "%s\"%s\": %llu", sep, exit_reason_name(r), (unsigned long long)total.exits[r]);
+        sep = ", ";
+    }
+
+    fprintf(stderr, "}, \"addresses\": [");
+    for (size_t a = 0; a < total.addr_count; ++a) {
+        const struct vm_stats_addr *addr = &total.addrs[a];
+        fprintf(stderr, "%s{\"type\": \"%s\", \"addr\": %llu, \"dir\": \"%s\", \"count\": %llu}", a ? ", " : "",
+            addr->mmio ? "mmio" : "port", (unsigned long long)addr->addr, addr->write ? "write" : "read",
+            (unsigned long long)addr->count);
+    }
+
+    fprintf(stderr, "], \"other_addresses\": %llu, ", (unsigned long long)total.other_addrs);
+    stats_print_hist_json("guest_ns", total.guest_ns, total.guest_hist);
+    fprintf(stderr, ", ");
+    stats_print_hist_json("handler_ns", total.handler_ns, total.handler_hist);
+    if (mem_ok) {
+        fprintf(stderr, ", \"memory_kib\": {\"rss\": %llu, \"pss\": %llu, \"shared\": %llu, \"private\": %llu, \"anon\": %llu}",
+            (unsigned long long)mem.rss, (unsigned long long)mem.pss, (unsigned long long)mem.shared,
+            (unsigned long long)mem.private, (unsigned long long)mem.anon);
+    }
+    if (vm->lazy.fd >= 0) {
+        fprintf(stderr, ", \"lazy\": {\"faults\": %llu, \"pages\": %llu}",
+            (unsigned long long)__atomic_load_n(&vm->lazy.faults, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&vm->lazy.pages, __ATOMIC_RELAXED));
+    }
+    fprintf(stderr, "}\n");
+}
+
+// SIGUSR1 asks for a report while the guest runs, the next vCPU to leave KVM_RUN prints it
+static volatile sig_atomic_t stats_requested;
+
+static void vm_stats_signal_handler(int sig) {
+    (void)sig;
+    stats_requested = 1;
+}
+
+// Prints the stats as a JSON object, histograms as arrays.
+static int kvm_stats_print(FILE *out, struct kvm_stats *stats) {
+    if (pread(stats->fd, stats->data, stats->data_size, stats->header.data_offset) != (ssize_t)stats->data_size) {
+        perror("read stats");
+        return -1;
+    }
+
+    fprintf(out, "{");
+    for (size_t i = 0; i < stats->header.num_desc; ++i) {
+        const struct kvm_stats_desc *desc = (const struct kvm_stats_desc*)(stats->descs + i * stats->desc_size);
+        const uint64_t *values = stats->data + desc->offset / sizeof(uint64_t);
+
+        fprintf(out, "%s\"%s\": ", i ? ", " : "", desc->name);
+        if (desc->size == 1) {
+            fprintf(out, "%llu", (unsigned long long)values[0]);
+            continue;
+        }
+
+        fprintf(out, "[");
+        for (size_t v = 0; v < desc->size; ++v)
+            fprintf(out, "%s%llu", v ? ", " : "", (unsigned long long)values[v]);
+        fprintf(out, "]");
+    }
+    fprintf(out, "}");
+
+    return 0;
+}
+
+// Writes one sample of all stats as a line of JSON. A single write keeps lines
+// whole when several VMs (server mode) share the file.
+static int vm_metrics_sample(struct vm_state *vm) {
+    char *line = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&line, &len);
+    if (!out) {
+        perror("open_memstream");
+        return -1;
+    }
+
+    int r = 0;
+    fprintf(out, "{\"time_ns\": %llu, \"vm\": ", (unsigned long long)now_ns());
+    r |= kvm_stats_print(out, &vm->kvm_stats[0]);
+    fprintf(out, ", \"vcpus\": [");
+    for (size_t i = 0; i < vm->cpu_count; ++i) {
+        fprintf(out, i ? ", " : "");
+        r |= kvm_stats_print(out, &vm->kvm_stats[i + 1]);
+    }
+    fprintf(out, "]}\n");
+    fclose(out);
+
+    if (r == 0 && write(vm->metrics_fd, line, len) != (ssize_t)len) {
+        perror("write metrics");
+        r = -1;
+    }
+
+    free(line);
+    return r;
+}
+
+static void *vm_metrics_thread(void *arg) {
+    struct vm_state *vm = arg;
+
+    // signals are meant for vCPU threads, they have to leave KVM_RUN
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    pthread_mutex_lock(&vm->metrics_lock);
+    while (!vm->metrics_stop) {
+        next.tv_sec += vm->metrics_interval_ms / 1000;
+        next.tv_nsec += (vm->metrics_interval_ms % 1000) * 1000000;
+        if (next.tv_nsec >= 1000000000) {
+            ++next.tv_sec;
+            next.tv_nsec -= 1000000000;
+        }
+
+        while (!vm->metrics_stop && pthread_cond_timedwait(&vm->metrics_cond, &vm->metrics_lock, &next) != ETIMEDOUT)
+            ;
+        if (vm->metrics_stop)
+            break;
+
+        if (vm_metrics_sample(vm) < 0)
+            break;
+    }
+    pthread_mutex_unlock(&vm->metrics_lock);
+
+    return NULL;
+}
+
+// Samples stats every interval while the vCPUs run, and once more when they stop.
+static int vm_start_metrics(struct vm_state *vm) {
+    if (!vm->kvm_stats)
+        return 0;
+
+    vm->metrics_stop = 0;
+    int err = pthread_create(&vm->metrics_thread, NULL, vm_metrics_thread, vm);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void vm_stop_metrics(struct vm_state *vm) {
+    if (!vm->kvm_stats)
+        return;
+
+    pthread_mutex_lock(&vm->metrics_lock);
+    vm->metrics_stop = 1;
+    pthread_cond_signal(&vm->metrics_cond);
+    pthread_mutex_unlock(&vm->metrics_lock);
+    pthread_join(vm->metrics_thread, NULL);
+
+    vm_metrics_sample(vm);
+}
+
+// vm_run result when the guest reached the checkpoint in snapshot mode
+#define VM_RUN_CHECKPOINT 1
+
+static int vm_stopping(struct vm_state *vm) {
+    return __atomic_load_n(&vm->stop, __ATOMIC_ACQUIRE);
+}
+
+static void vm_kick_handler(int sig) {
+    (void)sig;
+}
+
+// Makes every vCPU leave KVM_RUN (or a blocking serial read) and return from vm_run.
+// Can be called from any thread while the vCPUs run.
+static void vm_stop(struct vm_state *vm, const struct vm_cpu *self) {
+    __atomic_store_n(&vm->stop, 1, __ATOMIC_RELEASE);
+
+    // a vCPU that returned may be joined any moment
+    pthread_mutex_lock(&vm->kick_lock);
+    for (size_t i = 0; i < vm->cpu_count; ++i) {
+        struct vm_cpu *cpu = &vm->cpus[i];
+        if (cpu == self || !cpu->thread || cpu->exited)
+            continue;
+        __atomic_store_n(&cpu->run->immediate_exit, 1, __ATOMIC_RELEASE);
+        pthread_kill(cpu->thread, SIGUSR2);
+    }
+    pthread_mutex_unlock(&vm->kick_lock);
+
+    // vCPUs waiting for UART input
+    if (vm->uart.enabled) {
+        pthread_mutex_lock(&vm->serial.in_lock);
+        pthread_cond_broadcast(&vm->uart.cond);
+        pthread_mutex_unlock(&vm->serial.in_lock);
+    }
+}
+
+static int vm_handle_serial(struct vm_cpu *cpu) {
+    struct kvm_run *run = cpu->run;
+    uint8_t *data = ((uint8_t*)run) + run->io.data_offset;
+    size_t len = (size_t)run->io.count * run->io.size;
+
+    if (run->io.direction == KVM_EXIT_IO_OUT)
+        return serial_write(&cpu->vm->serial, data, len) < 0 ? -1 : 1;
+
+    struct input_log *log = &cpu->vm->input_log;
+    if (log->fd >= 0 && log->replay) {
+        ssize_t r = input_log_replay(log, cpu->exits, data, len);
+        return r < 0 ? -1 : (size_t)r == len ? 1 : 0;
+    }
+
+    ssize_t r = serial_read(&cpu->vm->serial, data, len);
+    while (r < 0 && errno == EINTR && !vm_stopping(cpu->vm))
+        r = serial_read(&cpu->vm->serial, data, len);
+
+    if (r < 0)
+        return vm_stopping(cpu->vm) ? 0 : -1;
+
+    if (log->fd >= 0 && r > 0 && input_log_record(log, cpu->exits, data, r) < 0)
+        return -1;
+
+    // EOF stops the guest
+    return (size_t)r == len ? 1 : 0;
+}
+
+#define UART_IER_RDI 0x01
+#define UART_IER_THRI 0x02
+#define UART_IER_MSI 0x08
+#define UART_IIR_NO_INT 0x01
+#define UART_IIR_THRI 0x02
+#define UART_IIR_RDI 0x04
+#define UART_LSR_DR 0x01
+#define UART_LSR_THRE 0x20
+#define UART_LSR_TEMT 0x40
+#define UART_MSR_DCD 0x80
+#define UART_MSR_DSR 0x20
+#define UART_MSR_CTS 0x10
+#define UART_MSR_DDCD 0x08
+#define UART_LCR_DLAB 0x80
+
+static int uart_data_ready(const struct vm_state *vm) {
+    return vm->serial.in_pos < vm->serial.in_len;
+}
+
+// Pending interrupt by priority: received data, THR empty, modem status (DCD drops at EOF).
+static uint8_t uart_iir(const struct vm_state *vm) {
+    const struct uart *uart = &vm->uart;
+    const uint8_t fifo = uart->fcr & 1 ? 0xC0 : 0;
+
+    if ((uart->ier & UART_IER_RDI) && uart_data_ready(vm))
+        return fifo | UART_IIR_RDI;
+    if ((uart->ier & UART_IER_THRI) && uart->thre_pending)
+        return fifo | UART_IIR_THRI;
+    if ((uart->ier & UART_IER_MSI) && uart->msr_delta)
+        return fifo;
+    return fifo | UART_IIR_NO_INT;
+}
+
+// irqfd only delivers edges: the IRQ is raised when the condition appears, and again
+// after the guest took some input while more is waiting.
+static void uart_update_irq(struct vm_state *vm, int retrigger) {
+    struct uart *uart = &vm->uart;
+    const int level = !(uart_iir(vm) & UART_IIR_NO_INT);
+
+    if (level && (!uart->irq_level || retrigger)) {
+        const uint64_t one = 1;
+        if (write(uart->irq_fd, &one, sizeof(one)) != sizeof(one))
+            perror("write irqfd");
+    }
+    uart->irq_level = level;
+}
+
+static uint8_t uart_read_reg(struct vm_state *vm, unsigned reg) {
+    struct uart *uart = &vm->uart;
+    const int dlab = uart->lcr & UART_LCR_DLAB;
+
+    switch (reg) {
+    case 0:
+        return uart->dll;
+    case 1:
+        return dlab ? uart->dlm : uart->ier;
+    case 2: {
+        const uint8_t iir = uart_iir(vm);
+        // reading IIR is how the guest acknowledges THR empty
+        if ((iir & 0x0F) == UART_IIR_THRI)
+            uart->thre_pending = 0;
+        return iir;
+    }
+    case 3:
+        return uart->lcr;
+    case 4:
+        return uart->mcr;
+    case 5:
+        // output never waits, the transmitter is always empty
+        return (uart_data_ready(vm) ? UART_LSR_DR : 0) | UART_LSR_THRE | UART_LSR_TEMT;
+    case 6: {
+        const uint8_t msr = (uart->eof ? 0 : UART_MSR_DCD) | UART_MSR_DSR | UART_MSR_CTS |
+            (uart->msr_delta ? UART_MSR_DDCD : 0);
+        uart->msr_delta = 0;
+        return msr;
+    }
+    default:
+        return uart->scr;
+    }
+}
+
+static void uart_write_reg(struct vm_state *vm, unsigned reg, uint8_t value) {
+    struct uart *uart = &vm->uart;
+    const int dlab = uart->lcr & UART_LCR_DLAB;
+
+    switch (reg) {
+    case 0:
+        uart->dll = value;
+        break;
+    case 1:
+        if (dlab) {
+            uart->dlm = value;
+            break;
+        }
+        // enabling the THR empty interrupt raises it right away
+        if ((value & UART_IER_THRI) && !(uart->ier & UART_IER_THRI))
+            uart->thre_pending = 1;
+        uart->ier = value & 0x0F;
+        break;
+    case 2:
+        uart->fcr = value;
+        break;
+    case 3:
+        uart->lcr = value;
+        break;
+    case 4:
+        uart->mcr = value;
+        break;
+    case 7:
+        uart->scr = value;
+        break;
+    default:
+        break;
+    }
+}
+
+// Waits for the reader thread when there's no input, so guests that don't look at LSR work too.
+// Returns less than len only at EOF, -1 with EINTR when the VM is stopping.
+static ssize_t uart_read_locked(struct vm_state *vm, uint8_t *data, size_t len) {
+    struct serial *serial = &vm->serial;
+    size_t done = 0;
+
+    while (done < len) {
+        if (!uart_data_ready(vm)) {
+            if (vm->uart.eof)
+                break;
+            if (vm_stopping(vm)) {
+                errno = EINTR;
+                return -1;
+            }
+            if (serial_flush(serial) < 0)
+                return -1;
+            pthread_cond_wait(&vm->uart.cond, &serial->in_lock);
+            continue;
+        }
+
+        size_t chunk = serial->in_len - serial->in_pos;
+        if (chunk > len - done)
+            chunk = len - done;
+
+        memcpy(data + done, serial->in + serial->in_pos, chunk);
+        serial->in_pos += chunk;
+        done += chunk;
+
+        // the reader thread has the next chunk ready
+        if (!uart_data_ready(vm))
+            pthread_cond_broadcast(&vm->uart.cond);
+    }
+
+    return done;
+}
+
+static int vm_handle_uart(struct vm_cpu *cpu) {
+    struct vm_state *vm = cpu->vm;
+    struct kvm_run *run = cpu->run;
+    uint8_t *data = ((uint8_t*)run) + run->io.data_offset;
+    const size_t len = (size_t)run->io.count * run->io.size;
+    const unsigned reg = run->io.port - SERIAL_PORT;
+    const int dlab = vm->uart.lcr & UART_LCR_DLAB;
+    int r = 1;
+
+    pthread_mutex_lock(&vm->serial.in_lock);
+
+    if (run->io.direction == KVM_EXIT_IO_OUT) {
+        if (reg == 0 && !dlab) {
+            if (serial_write(&vm->serial, data, len) < 0)
+                r = -1;
+            vm->uart.thre_pending = 1;
+        } else {
+            for (size_t i = 0; i < len; ++i)
+                uart_write_reg(vm, reg, data[i]);
+        }
+        uart_update_irq(vm, 0);
+    } else if (reg == 0 && !dlab) {
+        ssize_t n = uart_read_locked(vm, data, len);
+        if (n < 0)
+            r = vm_stopping(vm) ? 0 : -1;
+        else if ((size_t)n < len)
+            r = 0; // EOF stops the guest
+        uart_update_irq(vm, 1);
+    } else {
+        for (size_t i = 0; i < len; ++i)
+            data[i] = uart_read_reg(vm, reg);
+        uart_update_irq(vm, 0);
+    }
+
+    pthread_mutex_unlock(&vm->serial.in_lock);
+    return r;
+}
+
+// Reads stdin ahead of the guest: the next chunk waits here until the guest consumed the
+// previous one, so input is never dropped.
+static void *uart_reader_thread(void *arg) {
+    struct vm_state *vm = arg;
+    struct serial *serial = &vm->serial;
+    struct uart *uart = &vm->uart;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    uint8_t *buf = malloc(SERIAL_BUFFER_SIZE);
+    if (!buf) {
+        perror("malloc");
+        return NULL;
+    }
+
+    for (int done = 0; !done; ) {
+        struct pollfd fds[2] = {
+            { .fd = serial->in_fd, .events = POLLIN },
+            { .fd = uart->stop_fd, .events = POLLIN }
+        };
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll serial");
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        ssize_t r = read(serial->in_fd, buf, SERIAL_BUFFER_SIZE);
+        if (r < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        // a broken input is as good as its end
+        if (r < 0)
+            perror("read serial");
+
+        pthread_mutex_lock(&serial->in_lock);
+        while (uart_data_ready(vm) && !uart->reader_stop)
+            pthread_cond_wait(&uart->cond, &serial->in_lock);
+
+        if (!uart->reader_stop) {
+            if (r > 0) {
+                memcpy(serial->in, buf, r);
+                serial->in_pos = 0;
+                serial->in_len = r;
+            } else {
+                uart->eof = 1;
+                uart->msr_delta = 1;
+            }
+            uart_update_irq(vm, 0);
+            pthread_cond_broadcast(&uart->cond);
+        }
+
+        done = uart->reader_stop || r <= 0;
+        pthread_mutex_unlock(&serial->in_lock);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static int uart_start(struct vm_state *vm) {
+    if (!vm->uart.enabled)
+        return 0;
+
+    vm->uart.reader_stop = 0;
+    int err = pthread_create(&vm->uart.reader, NULL, uart_reader_thread, vm);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void uart_stop(struct vm_state *vm) {
+    if (!vm->uart.enabled)
+        return;
+
+    pthread_mutex_lock(&vm->serial.in_lock);
+    vm->uart.reader_stop = 1;
+    pthread_cond_broadcast(&vm->uart.cond);
+    pthread_mutex_unlock(&vm->serial.in_lock);
+
+    const uint64_t one = 1;
+    if (write(vm->uart.stop_fd, &one, sizeof(one)) != sizeof(one))
+        perror("write eventfd");
+    pthread_join(vm->uart.reader, NULL);
+
+    uint64_t count = 0;
+    if (read(vm->uart.stop_fd, &count, sizeof(count)) != sizeof(count))
+        perror("read eventfd");
+}
+
+// Writes out everything between tail and head, serial output buffered before it goes first.
+// Returns the number of ring bytes written or -1.
+static ssize_t output_ring_drain(struct vm_state *vm) {
+    struct output_ring *ring = &vm->output;
+    struct serial *serial = &vm->serial;
+    uint8_t *base = (uint8_t*)vm->mem + ring->addr;
+    uint32_t *head_ptr = (uint32_t*)(base + OUTPUT_RING_HEAD);
+    uint32_t *tail_ptr = (uint32_t*)(base + OUTPUT_RING_TAIL);
+    uint8_t *data = base + OUTPUT_RING_DATA;
+
+    pthread_mutex_lock(&serial->out_lock);
+    int r = serial_flush_locked(serial);
+    ssize_t written = 0;
+    while (r == 0) {
+        const uint32_t head = __atomic_load_n(head_ptr, __ATOMIC_ACQUIRE);
+        const uint32_t tail = __atomic_load_n(tail_ptr, __ATOMIC_RELAXED);
+        const uint32_t len = head - tail;
+        if (len == 0)
+            break;
+        if (len > ring->size) {
+            fprintf(stderr, "Output ring overrun: head %u, tail %u\n", head, tail);
+            r = -1;
+            break;
+        }
+
+        struct iovec iov[2];
+        int iovcnt = 1;
+        const size_t pos = tail & (ring->size - 1);
+        const size_t first = ring->size - pos;
+        iov[0].iov_base = data + pos;
+        iov[0].iov_len = len < first ? len : first;
+        if (len > first) {
+            iov[1].iov_base = data;
+            iov[1].iov_len = len - first;
+            iovcnt = 2;
+        }
+
+        ssize_t n = writev(serial->out_fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write output ring");
+            r = -1;
+            break;
+        }
+
+        // frees the space for the guest
+        __atomic_store_n(tail_ptr, tail + (uint32_t)n, __ATOMIC_RELEASE);
+        written += n;
+    }
+    pthread_mutex_unlock(&serial->out_lock);
+
+    return r < 0 ? -1 : written;
+}
+
+static int output_ring_empty(struct vm_state *vm) {
+    const uint8_t *base = (uint8_t*)vm->mem + vm->output.addr;
+    return __atomic_load_n((const uint32_t*)(base + OUTPUT_RING_HEAD), __ATOMIC_ACQUIRE) ==
+        __atomic_load_n((const uint32_t*)(base + OUTPUT_RING_TAIL), __ATOMIC_RELAXED);
+}
+
+// Waits for the doorbell, or in a polled ring for data: spins for a while after the last data,
+// then sleeps longer and longer on the doorbell, which the guest may still ring and stop uses
+// to wake us. Returns -1 if the doorbell failed.
+static int output_ring_wait(struct vm_state *vm, uint64_t *sleep_ns) {
+    struct output_ring *ring = &vm->output;
+    struct pollfd pfd = {
+        .fd = ring->doorbell_fd,
+        .events = POLLIN
+    };
+    int r = 1;
+
+    if (ring->poll) {
+        for (int i = 0; i < ring->spins; ++i) {
+            if (!output_ring_empty(vm) || __atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE))
+                return 0;
+            __builtin_ia32_pause();
+        }
+
+        const struct timespec timeout = {
+            .tv_sec = *sleep_ns / 1000000000,
+            .tv_nsec = *sleep_ns % 1000000000
+        };
+        r = ppoll(&pfd, 1, &timeout, NULL);
+        if (r < 0 && errno != EINTR) {
+            perror("poll doorbell");
+            return -1;
+        }
+        *sleep_ns = *sleep_ns * 2 < OUTPUT_POLL_MAX_SLEEP_NS ? *sleep_ns * 2 : OUTPUT_POLL_MAX_SLEEP_NS;
+    }
+
+    uint64_t count = 0;
+    if (r > 0 && read(ring->doorbell_fd, &count, sizeof(count)) != sizeof(count) && errno != EINTR) {
+        perror("read doorbell");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *output_ring_thread(void *arg) {
+    struct vm_state *vm = arg;
+    struct output_ring *ring = &vm->output;
+    uint64_t sleep_ns = OUTPUT_POLL_MIN_SLEEP_NS;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (;;) {
+        // data the guest added without ringing is written out on stop as well
+        const int stop = __atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE);
+        const ssize_t n = output_ring_drain(vm);
+        if (n < 0)
+            break;
+        if (stop)
+            return NULL;
+
+        // a polled ring is checked again right away while the guest keeps writing
+        if (n > 0 && ring->poll) {
+            sleep_ns = OUTPUT_POLL_MIN_SLEEP_NS;
+            continue;
+        }
+        if (output_ring_wait(vm, &sleep_ns) < 0)
+            break;
+    }
+
+    __atomic_store_n(&ring->failed, 1, __ATOMIC_RELEASE);
+    vm_stop(vm, NULL);
+    return NULL;
+}
+
+static int output_ring_start(struct vm_state *vm) {
+    if (!vm->output.size)
+        return 0;
+
+    vm->output.stop = 0;
+    vm->output.failed = 0;
+    int err = pthread_create(&vm->output.thread, NULL, output_ring_thread, vm);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns -1 if the ring couldn't be written out.
+static int output_ring_stop(struct vm_state *vm) {
+    if (!vm->output.size)
+        return 0;
+
+    __atomic_store_n(&vm->output.stop, 1, __ATOMIC_RELEASE);
+    const uint64_t one = 1;
+    if (write(vm->output.doorbell_fd, &one, sizeof(one)) != sizeof(one))
+        perror("write eventfd");
+    pthread_join(vm->output.thread, NULL);
+
+    return vm->output.failed ? -1 : 0;
+}
+
+static void queue_notify(struct vm_queue *queue) {
+    if (!queue->irq_pending)
+        return;
+    queue->irq_pending = 0;
+
+    if (queue->irq_fd < 0 || (__atomic_load_n(&queue->ring.avail->flags, __ATOMIC_ACQUIRE) & VRING_AVAIL_F_NO_INTERRUPT))
+        return;
+
+    const uint64_t one = 1;
+    if (write(queue->irq_fd, &one, sizeof(one)) != sizeof(one))
+        perror("write eventfd");
+}
+
+// Waits for the guest to ring. Returns 1 when the queue is stopping, -1 on error.
+static int queue_wait_doorbell(struct vm_queue *queue) {
+    uint64_t count = 0;
+    while (read(queue->doorbell_fd, &count, sizeof(count)) != sizeof(count)) {
+        if (errno != EINTR) {
+            perror("read doorbell");
+            return -1;
+        }
+    }
+
+    return __atomic_load_n(&queue->stop, __ATOMIC_ACQUIRE) ? 1 : 0;
+}
+
+// Device-readable buffers go to stdout, after the serial output buffered so far.
+static int queue_write(struct vm_state *vm, struct iovec *iov, int iovcnt) {
+    struct serial *serial = &vm->serial;
+    pthread_mutex_lock(&serial->out_lock);
+    int r = serial_flush_locked(serial);
+
+    while (r == 0 && iovcnt > 0) {
+        ssize_t n = writev(serial->out_fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write queue");
+            r = -1;
+            break;
+        }
+
+        for (; iovcnt > 0 && (size_t)n >= iov->iov_len; ++iov, --iovcnt)
+            n -= iov->iov_len;
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    pthread_mutex_unlock(&serial->out_lock);
+    return r;
+}
+
+// Fills device-writable buffers with whatever one read from stdin returns, input the serial
+// port has buffered comes first. Returns the length filled (0 at EOF) or -1.
+static ssize_t queue_read(struct vm_state *vm, struct iovec *iov, int iovcnt) {
+    struct serial *serial = &vm->serial;
+
+    pthread_mutex_lock(&serial->in_lock);
+    if (serial->in_pos < serial->in_len) {
+        size_t done = 0;
+        for (int i = 0; i < iovcnt && serial->in_pos < serial->in_len; ++i) {
+            size_t chunk = serial->in_len - serial->in_pos;
+            if (chunk > iov[i].iov_len)
+                chunk = iov[i].iov_len;
+            memcpy(iov[i].iov_base, serial->in + serial->in_pos, chunk);
+            serial->in_pos += chunk;
+            done += chunk;
+        }
+        pthread_mutex_unlock(&serial->in_lock);
+        return done;
+    }
+    const int in_fd = serial->in_fd;
+    pthread_mutex_unlock(&serial->in_lock);
+
+    ssize_t n = readv(in_fd, iov, iovcnt);
+    while (n < 0 && (errno == EINTR || errno == EAGAIN))
+        n = readv(in_fd, iov, iovcnt);
+    if (n < 0)
+        perror("read queue");
+
+    return n;
+}
+
+// Returns 1 if stdin or the serial port's buffer has input for a read, 0 if not, -1 on error.
+// With wait set it blocks until there is input or the guest rings.
+static int queue_poll_input(struct vm_state *vm, int wait) {
+    struct serial *serial = &vm->serial;
+    struct vm_queue *queue = &vm->queue;
+
+    pthread_mutex_lock(&serial->in_lock);
+    const int buffered = serial->in_pos < serial->in_len;
+    const int in_fd = serial->in_fd;
+    pthread_mutex_unlock(&serial->in_lock);
+    if (buffered)
+        return 1;
+
+    struct pollfd fds[2] = {
+        { .fd = in_fd, .events = POLLIN },
+        { .fd = queue->doorbell_fd, .events = POLLIN }
+    };
+    while (poll(fds, wait ? 2 : 1, wait ? -1 : 0) < 0) {
+        if (errno != EINTR) {
+            perror("poll queue");
+            return -1;
+        }
+    }
+
+    if (fds[0].revents)
+        return 1;
+    // the caller checks the avail ring and stop again
+    if (wait && fds[1].revents && queue_wait_doorbell(queue) < 0)
+        return -1;
+    return 0;
+}
+
+// Collects the chain starting at head: readable descriptors into out unless it's NULL,
+// then writable ones into in.
+static int queue_chain(struct vm_state *vm, uint16_t head, struct iovec *out, int *out_count,
+    struct iovec *in, int *in_count) {
+    struct vm_queue *queue = &vm->queue;
+    *out_count = 0;
+    *in_count = 0;
+
+    uint16_t i = head;
+    for (unsigned n = 0; ; ++n) {
+        if (i >= queue->size || n == queue->size) {
+            fprintf(stderr, "Queue: bad descriptor chain at %u\n", head);
+            return -1;
+        }
+
+        const struct vring_desc *desc = &queue->ring.desc[i];
+        const uint64_t addr = desc->addr;
+        const uint32_t len = desc->len;
+        const uint16_t flags = desc->flags;
+        if (addr > vm->mem_size || vm->mem_size - addr < len || (flags & VRING_DESC_F_INDIRECT)) {
+            fprintf(stderr, "Queue: bad descriptor %u: addr 0x%llx, len %u, flags 0x%x\n",
+                i, (unsigned long long)addr, len, flags);
+            return -1;
+        }
+
+        struct iovec iov = { (uint8_t*)vm->mem + addr, len };
+        if (flags & VRING_DESC_F_WRITE) {
+            in[(*in_count)++] = iov;
+        } else if (*in_count == 0) {
+            if (out)
+                out[*out_count] = iov;
+            ++*out_count;
         } else {
-            fprintf(stderr, "Read %ux%u bytes at port %04x\n\n",
-                vm->run->io.count, vm->run->io.size, vm->run->io.port);
+            fprintf(stderr, "Queue: readable descriptor %u after writable ones\n", i);
+            return -1;
+        }
+
+        if (!(flags & VRING_DESC_F_NEXT))
+            break;
+        i = desc->next;
+    }
+
+    return 0;
+}
+
+static void queue_complete(struct vm_queue *queue, uint16_t head, uint32_t len) {
+    struct vring_used_elem *elem = &queue->ring.used->ring[queue->used_idx % queue->size];
+    elem->id = head;
+    elem->len = len;
+    __atomic_store_n(&queue->ring.used->idx, ++queue->used_idx, __ATOMIC_RELEASE);
+    queue->irq_pending = 1;
+}
+
+// Fills the oldest chain waiting for input and completes it.
+static int queue_serve_pending(struct vm_state *vm) {
+    struct vm_queue *queue = &vm->queue;
+    struct iovec in[QUEUE_MAX_SIZE];
+    int out_count;
+    int in_count;
+
+    const uint16_t head = queue->pending[queue->pending_first];
+    if (queue_chain(vm, head, NULL, &out_count, in, &in_count) < 0)
+        return -1;
+
+    ssize_t len = queue_read(vm, in, in_count);
+    if (len < 0)
+        return -1;
+
+    queue->pending_first = (queue->pending_first + 1) % queue->size;
+    --queue->pending_count;
+    queue_complete(queue, head, len);
+    return 0;
+}
+
+// Serves the chain starting at head. Its device-readable buffers are written out right away,
+// writable ones are filled now only if input is there and no earlier chain waits for it,
+// otherwise the chain waits while later chains are served.
+static int queue_process(struct vm_state *vm, uint16_t head) {
+    struct vm_queue *queue = &vm->queue;
+    struct iovec out[QUEUE_MAX_SIZE];
+    struct iovec in[QUEUE_MAX_SIZE];
+    int out_count;
+    int in_count;
+
+    if (queue_chain(vm, head, out, &out_count, in, &in_count) < 0)
+        return -1;
+
+    if (out_count > 0 && queue_write(vm, out, out_count) < 0)
+        return -1;
+
+    if (in_count == 0) {
+        queue_complete(queue, head, 0);
+        return 0;
+    }
+
+    if (queue->pending_count == 0) {
+        const int ready = queue_poll_input(vm, 0);
+        if (ready < 0)
+            return -1;
+        if (ready) {
+            ssize_t len = queue_read(vm, in, in_count);
+            if (len < 0)
+                return -1;
+            queue_complete(queue, head, len);
+            return 0;
+        }
+    }
+
+    if (queue->pending_count == queue->size) {
+        fprintf(stderr, "Queue: more chains in flight than descriptors\n");
+        return -1;
+    }
+    queue->pending[(queue->pending_first + queue->pending_count++) % queue->size] = head;
+    return 0;
+}
+
+static void *queue_thread(void *arg) {
+    struct vm_state *vm = arg;
+    struct vm_queue *queue = &vm->queue;
+    struct vring *ring = &queue->ring;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (;;) {
+        if (__atomic_load_n(&queue->stop, __ATOMIC_ACQUIRE))
+            return NULL;
+
+        const uint16_t avail_idx = __atomic_load_n(&ring->avail->idx, __ATOMIC_ACQUIRE);
+        if (avail_idx == queue->last_avail) {
+            queue_notify(queue);
+
+            // ask for the doorbell and look once more, the guest may have missed the flag
+            __atomic_store_n(&ring->used->flags, 0, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->avail->idx, __ATOMIC_ACQUIRE) == queue->last_avail) {
+                if (queue->pending_count > 0) {
+                    const int ready = queue_poll_input(vm, 1);
+                    if (ready < 0 || (ready > 0 && queue_serve_pending(vm) < 0))
+                        break;
+                } else {
+                    int r = queue_wait_doorbell(queue);
+                    if (r < 0)
+                        break;
+                    if (r > 0)
+                        return NULL;
+                }
+            }
+
+            // no doorbells needed while the thread is busy anyway
+            __atomic_store_n(&ring->used->flags, VRING_USED_F_NO_NOTIFY, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if ((uint16_t)(avail_idx - queue->last_avail) > queue->size) {
+            fprintf(stderr, "Queue: bad avail index %u\n", avail_idx);
+            break;
+        }
+
+        const uint16_t head = ring->avail->ring[queue->last_avail % queue->size];
+        if (queue_process(vm, head) < 0)
+            break;
+        ++queue->last_avail;
+    }
+
+    // stopping while waiting for input isn't a failure
+    if (!__atomic_load_n(&queue->stop, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&queue->failed, 1, __ATOMIC_RELEASE);
+        vm_stop(vm, NULL);
+    }
+    return NULL;
+}
+
+// The host side of the queue lives in guest memory too, so it's picked up from
+// there. The queue is zeroed at boot and a VM's memory is fresh for every job.
+static int queue_start(struct vm_state *vm) {
+    struct vm_queue *queue = &vm->queue;
+    if (!queue->size)
+        return 0;
+
+    queue->used_idx = __atomic_load_n(&queue->ring.used->idx, __ATOMIC_ACQUIRE);
+    queue->last_avail = queue->used_idx;
+    queue->pending_first = 0;
+    queue->pending_count = 0;
+    queue->irq_pending = 0;
+    queue->stop = 0;
+    queue->failed = 0;
+    int err = pthread_create(&queue->thread, NULL, queue_thread, vm);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int queue_stop(struct vm_state *vm) {
+    struct vm_queue *queue = &vm->queue;
+    if (!queue->size)
+        return 0;
+
+    __atomic_store_n(&queue->stop, 1, __ATOMIC_RELEASE);
+    const uint64_t one = 1;
+    if (write(queue->doorbell_fd, &one, sizeof(one)) != sizeof(one))
+        perror("write eventfd");
+    pthread_join(queue->thread, NULL);
+
+    return queue->failed ? -1 : 0;
+}
+
+static int vm_drain_console(struct vm_state *vm) {
+    struct kvm_coalesced_mmio_ring *ring = vm->console_ring;
+    if (!ring)
+        return 0;
+
+    int r = 0;
+    pthread_mutex_lock(&vm->console_lock);
+
+    const uint32_t max = KVM_COALESCED_MMIO_MAX;
+    while (ring->first != __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE)) {
+        struct kvm_coalesced_mmio *entry = &ring->coalesced_mmio[ring->first];
+        if (serial_write(&vm->serial, entry->data, entry->len) < 0) {
+            r = -1;
+            break;
+        }
+        __atomic_store_n(&ring->first, (ring->first + 1) % max, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&vm->console_lock);
+    return r;
+}
+
+// Stops the VM when the time limit runs out.
+static void *vm_deadline_thread(void *arg) {
+    struct vm_state *vm = arg;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += vm->time_limit_ms / 1000;
+    deadline.tv_nsec += (vm->time_limit_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&vm->deadline_lock);
+    int expired = 0;
+    while (!vm->deadline_stop && !expired)
+        expired = pthread_cond_timedwait(&vm->deadline_cond, &vm->deadline_lock, &deadline) == ETIMEDOUT;
+    pthread_mutex_unlock(&vm->deadline_lock);
+
+    if (expired && !vm_stopping(vm)) {
+        fprintf(stderr, "Time limit of %zu ms exceeded\n", vm->time_limit_ms);
+        __atomic_store_n(&vm->limit_hit, VM_LIMIT_TIME, __ATOMIC_RELEASE);
+        vm_stop(vm, NULL);
+    }
+
+    return NULL;
+}
+
+static int vm_start_deadline(struct vm_state *vm) {
+    if (!vm->time_limit_ms)
+        return 0;
+
+    vm->deadline_stop = 0;
+    int err = pthread_create(&vm->deadline_thread, NULL, vm_deadline_thread, vm);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void vm_stop_deadline(struct vm_state *vm) {
+    if (!vm->time_limit_ms)
+        return;
+
+    pthread_mutex_lock(&vm->deadline_lock);
+    vm->deadline_stop = 1;
+    pthread_cond_signal(&vm->deadline_cond);
+    pthread_mutex_unlock(&vm->deadline_lock);
+    pthread_join(vm->deadline_thread, NULL);
+}
+
+// kvm_run of the vCPU on this thread, for signal handlers
+static __thread struct kvm_run *signal_run;
+static __thread volatile sig_atomic_t cycles_exhausted;
+
+// Makes sure the vCPU leaves KVM_RUN even if the signal came outside of it.
+static void vm_budget_signal_handler(int sig) {
+    (void)sig;
+    cycles_exhausted = 1;
+    if (signal_run)
+        __atomic_store_n(&signal_run->immediate_exit, 1, __ATOMIC_RELEASE);
+}
+
+// Counts guest cycles of the calling thread and sends it SIGXCPU once the budget is spent.
+static int vm_cpu_open_budget(struct vm_cpu *cpu) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CPU_CYCLES,
+        .sample_period = cpu->vm->cycle_budget,
+        .disabled = 1,
+        .exclude_host = 1
+    };
+
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) {
+        perror("perf_event_open cycle budget");
+        return -1;
+    }
+
+    struct f_owner_ex owner = {
+        .type = F_OWNER_TID,
+        .pid = syscall(SYS_gettid)
+    };
+
+    // REFRESH enables the counter for a single overflow, which signals without a sample buffer
+    if (fcntl(fd, F_SETOWN_EX, &owner) < 0 || fcntl(fd, F_SETSIG, SIGXCPU) < 0 ||
+            fcntl(fd, F_SETFL, O_ASYNC) < 0 || ioctl(fd, PERF_EVENT_IOC_REFRESH, 1) < 0) {
+        perror("cycle budget");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static __thread volatile sig_atomic_t profile_requested;
+
+// older glibc headers don't name it
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static void vm_profile_signal_handler(int sig) {
+    (void)sig;
+    profile_requested = 1;
+    if (signal_run)
+        __atomic_store_n(&signal_run->immediate_exit, 1, __ATOMIC_RELEASE);
+}
+
+// The timer runs on wall-clock time and signals the vCPU thread itself. CPU-time clocks would
+// only fire on scheduler ticks, a vCPU that waits for input or halts is sampled where it waits.
+static int vm_cpu_start_profile(struct vm_cpu *cpu, timer_t *timer) {
+    struct sigevent sev = {
+        .sigev_notify = SIGEV_THREAD_ID,
+        .sigev_signo = SIGPROF
+    };
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+
+    if (timer_create(CLOCK_MONOTONIC, &sev, timer) < 0) {
+        perror("timer_create profile");
+        return -1;
+    }
+
+    const uint64_t period_ns = 1000000000ull / cpu->vm->profile_hz;
+    struct itimerspec spec = {
+        .it_interval = { period_ns / 1000000000, period_ns % 1000000000 },
+        .it_value = { period_ns / 1000000000, period_ns % 1000000000 }
+    };
+
+    if (timer_settime(*timer, 0, &spec, NULL) < 0) {
+        perror("timer_settime profile");
+        timer_delete(*timer);
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint64_t profile_hash(uint64_t rip) {
+    return (rip * 0x9E3779B97F4A7C15ull) >> 20;
+}
+
+static struct vm_profile_entry *profile_find(struct vm_profile *profile, uint64_t rip) {
+    size_t i = profile_hash(rip) & (profile->capacity - 1);
+    while (profile->entries[i].count && profile->entries[i].rip != rip)
+        i = (i + 1) & (profile->capacity - 1);
+    return &profile->entries[i];
+}
+
+static int profile_add(struct vm_profile *profile, uint64_t rip, uint64_t count) {
+    // kept at most half full
+    if ((profile->used + 1) * 2 > profile->capacity) {
+        struct vm_profile old = *profile;
+        profile->capacity = old.capacity ? old.capacity * 2 : 1024;
+        profile->entries = calloc(profile->capacity, sizeof(struct vm_profile_entry));
+        if (!profile->entries) {
+            perror("malloc");
+            *profile = old;
+            return -1;
+        }
+
+        for (size_t i = 0; i < old.capacity; ++i) {
+            if (old.entries[i].count)
+                *profile_find(profile, old.entries[i].rip) = old.entries[i];
+        }
+        free(old.entries);
+    }
+
+    struct vm_profile_entry *entry = profile_find(profile, rip);
+    if (!entry->count) {
+        entry->rip = rip;
+        ++profile->used;
+    }
+    entry->count += count;
+    profile->samples += count;
+    return 0;
+}
+
+static int vm_profile_sample(struct vm_cpu *cpu) {
+    const struct kvm_regs *regs = vm_cpu_regs(cpu);
+    if (!regs)
+        return -1;
+
+    return profile_add(&cpu->profile, regs->rip, 1);
+}
+
+static int profile_entry_compare(const void *a, const void *b) {
+    const struct vm_profile_entry *x = a, *y = b;
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->rip < y->rip ? -1 : x->rip > y->rip;
+}
+
+#define PROFILE_REPORT_LINES 32
+
+// Hottest RIPs of all vCPUs: a text report on stderr, or folded lines ("rip count") for
+// flamegraph.pl and the like in the profile file.
+static void vm_profile_report(const struct vm_state *vm) {
+    if (!vm->profile_hz)
+        return;
+
+    struct vm_profile total = { 0 };
+    for (size_t i = 0; i < vm->cpu_count; ++i) {
+        const struct vm_profile *profile = &vm->cpus[i].profile;
+        for (size_t j = 0; j < profile->capacity; ++j) {
+            if (profile->entries[j].count && profile_add(&total, profile->entries[j].rip, profile->entries[j].count) < 0)
+                goto done;
+        }
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < total.capacity; ++i) {
+        if (total.entries[i].count)
+            total.entries[count++] = total.entries[i];
+    }
+    qsort(total.entries, count, sizeof(struct vm_profile_entry), profile_entry_compare);
+
+    if (vm->profile_fd >= 0) {
+        for (size_t i = 0; i < count; ++i)
+            dprintf(vm->profile_fd, "0x%016llx %llu\n",
+                (unsigned long long)total.entries[i].rip, (unsigned long long)total.entries[i].count);
+        goto done;
+    }
+
+    fprintf(stderr, "===== BEGIN PROFILE =====\n");
+    fprintf(stderr, "Samples: %llu at %zu Hz, %zu addresses\n", (unsigned long long)total.samples, vm->profile_hz, count);
+    for (size_t i = 0; i < count && i < PROFILE_REPORT_LINES; ++i) {
+        fprintf(stderr, "  %016llx %12llu %6.2f%%\n", (unsigned long long)total.entries[i].rip,
+            (unsigned long long)total.entries[i].count, 100.0 * total.entries[i].count / total.samples);
+    }
+    if (count > PROFILE_REPORT_LINES)
+        fprintf(stderr, "  %zu more addresses\n", count - PROFILE_REPORT_LINES);
+    fprintf(stderr, "===== END PROFILE =====\n\n");
+
+done:
+    free(total.entries);
+}
+
+static enum vm_exit_action vm_exit_io(struct vm_cpu *cpu) {
+    struct vm_state *vm = cpu->vm;
+    const uint8_t device = vm->pio[cpu->run->io.port];
+    if (!device)
+        return VM_EXIT_UNHANDLED;
+
+    const struct vm_device *dev = &vm->devices[device - 1];
+    return dev->handle(cpu, dev->data);
+}
+
+static enum vm_exit_action vm_exit_mmio(struct vm_cpu *cpu) {
+    struct vm_state *vm = cpu->vm;
+    const uint64_t addr = cpu->run->mmio.phys_addr;
+
+    // a vCPU usually hits the same range over and over
+    size_t i = cpu->mmio_hit;
+    if (i >= vm->mmio_count || addr - vm->mmio[i].addr >= vm->mmio[i].size) {
+        size_t lo = 0, hi = vm->mmio_count;
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (vm->mmio[mid].addr + vm->mmio[mid].size <= addr)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == vm->mmio_count || addr < vm->mmio[lo].addr)
+            return VM_EXIT_UNHANDLED;
+        i = cpu->mmio_hit = lo;
+    }
+
+    return vm->devices[vm->mmio[i].device].handle(cpu, vm->mmio[i].data);
+}
+
+static enum vm_exit_action vm_exit_hlt(struct vm_cpu *cpu) {
+    return __atomic_sub_fetch(&cpu->vm->running_cpus, 1, __ATOMIC_ACQ_REL) > 0 ? VM_EXIT_HALTED : VM_EXIT_STOP;
+}
+
+// The ring was full or coalescing is unavailable.
+static enum vm_exit_action vm_pio_console(struct vm_cpu *cpu, void *data) {
+    (void)data;
+    struct kvm_run *run = cpu->run;
+    if (run->io.direction != KVM_EXIT_IO_OUT)
+        return VM_EXIT_UNHANDLED;
+
+    const uint8_t *bytes = (const uint8_t*)run + run->io.data_offset;
+    return serial_write(&cpu->vm->serial, bytes, (size_t)run->io.count * run->io.size) < 0 ? VM_EXIT_FAIL : VM_EXIT_CONTINUE;
+}
+
+// Only the first checkpoint counts, it's a no-op otherwise.
+static enum vm_exit_action vm_pio_checkpoint(struct vm_cpu *cpu, void *data) {
+    (void)data;
+    struct vm_state *vm = cpu->vm;
+    if (cpu->run->io.direction != KVM_EXIT_IO_OUT)
+        return VM_EXIT_UNHANDLED;
+    if (!vm->wait_checkpoint)
+        return VM_EXIT_CONTINUE;
+
+    vm->wait_checkpoint = 0;
+    return VM_EXIT_CHECKPOINT;
+}
+
+static enum vm_exit_action vm_pio_exit(struct vm_cpu *cpu, void *data) {
+    (void)data;
+    struct kvm_run *run = cpu->run;
+    if (run->io.direction != KVM_EXIT_IO_OUT || run->io.size > sizeof(uint32_t))
+        return VM_EXIT_UNHANDLED;
+
+    uint32_t status = 0;
+    memcpy(&status, (uint8_t*)run + run->io.data_offset, run->io.size);
+    cpu->vm->exit_status = status;
+    return VM_EXIT_STOP;
+}
+
+static enum vm_exit_action vm_pio_serial(struct vm_cpu *cpu, void *data) {
+    (void)data;
+    if (cpu->run->io.size != 1)
+        return VM_EXIT_UNHANDLED;
+
+    const int r = cpu->vm->uart.enabled ? vm_handle_uart(cpu) : vm_handle_serial(cpu);
+    return r < 0 ? VM_EXIT_FAIL : r == 0 ? VM_EXIT_STOP : VM_EXIT_CONTINUE;
+}
+
+static enum vm_exit_action vm_mmio_rofile(struct vm_cpu *cpu, void *data) {
+    if (cpu->run->mmio.is_write) {
+        fprintf(stderr, "vCPU %d wrote to read-only %s at 0x%llx\n", cpu->id, (const char*)data,
+            (unsigned long long)cpu->run->mmio.phys_addr);
+    }
+    return VM_EXIT_UNHANDLED;
+}
+
+// Registers the built-in devices and exit handlers, once per VM. Devices with ioeventfds
+// (doorbell, queue) and the in-kernel irqchip never exit to blankvm.
+static int vm_setup_devices(struct vm_state *vm) {
+    vm->exit_handlers[KVM_EXIT_IO] = vm_exit_io;
+    vm->exit_handlers[KVM_EXIT_MMIO] = vm_exit_mmio;
+    vm->exit_handlers[KVM_EXIT_HLT] = vm_exit_hlt;
+
+    int console = vm_add_device(vm, "console", vm_pio_console, NULL);
+    int checkpoint = vm_add_device(vm, "checkpoint", vm_pio_checkpoint, NULL);
+    int exit = vm_add_device(vm, "exit", vm_pio_exit, NULL);
+    int serial = vm_add_device(vm, "serial", vm_pio_serial, NULL);
+    vm->rofile_device = vm_add_device(vm, "read-only file", vm_mmio_rofile, NULL);
+    if (console < 0 || checkpoint < 0 || exit < 0 || serial < 0 || vm->rofile_device < 0)
+        return -1;
+
+    // without the UART only the data register exists
+    if (vm_register_pio(vm, console, CONSOLE_PORT, 1) < 0 ||
+            vm_register_pio(vm, checkpoint, CHECKPOINT_PORT, 1) < 0 ||
+            vm_register_pio(vm, exit, EXIT_PORT, 1) < 0 ||
+            vm_register_pio(vm, serial, SERIAL_PORT, vm->uart.enabled ? 8 : 1) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int vm_run(struct vm_cpu *cpu) {
+    struct vm_state *vm = cpu->vm;
+    struct kvm_run *run = cpu->run;
+    const int stats = vm->stats_format != VM_STATS_NONE;
+    uint64_t exit_time = 0;
+
+    while (!vm_stopping(vm)) {
+        uint64_t enter_time = 0;
+        if (stats) {
+            enter_time = now_ns();
+            if (exit_time)
+                vm_stats_handler(&cpu->stats, enter_time - exit_time);
+            exit_time = 0;
+
+            if (__atomic_exchange_n(&stats_requested, 0, __ATOMIC_ACQ_REL)) {
+                pthread_mutex_lock(&vm->dump_lock);
+                vm_stats_report(vm);
+                pthread_mutex_unlock(&vm->dump_lock);
+            }
+        }
+
+        int r = ioctl(cpu->fd, KVM_RUN, 0);
+        vm_cpu_exited(cpu);
+        // a signal exit (KVM_EXIT_INTR) counts too
+        if (stats && (r == 0 || errno == EINTR)) {
+            exit_time = now_ns();
+            vm_stats_exit(&cpu->stats, run, exit_time - enter_time);
+        }
+
+        if (r < 0) {
+            if (errno == EINTR) {
+                __atomic_store_n(&run->immediate_exit, 0, __ATOMIC_RELEASE);
+                if (cycles_exhausted) {
+                    fprintf(stderr, "vCPU %d exceeded the cycle budget of %zu\n", cpu->id, vm->cycle_budget);
+                    __atomic_store_n(&vm->limit_hit, VM_LIMIT_CYCLES, __ATOMIC_RELEASE);
+                    break;
+                }
+                if (profile_requested) {
+                    profile_requested = 0;
+                    if (vm_profile_sample(cpu) < 0)
+                        goto fail;
+                }
+                continue;
+            }
+            perror("KVM_RUN");
+            goto fail;
+        }
+        ++cpu->exits;
+
+        // console writes queued before this exit go out first
+        if (vm_drain_console(vm) < 0)
+            goto fail;
+
+        enum vm_exit_action action = VM_EXIT_UNHANDLED;
+        if (run->exit_reason < VM_STATS_REASONS && vm->exit_handlers[run->exit_reason])
+            action = vm->exit_handlers[run->exit_reason](cpu);
+
+        if (action == VM_EXIT_CONTINUE)
+            continue;
+        if (action == VM_EXIT_STOP)
+            break;
+        if (action == VM_EXIT_FAIL)
+            goto fail;
+        // a halted vCPU can't be woken up, the VM stops with the last one
+        if (action == VM_EXIT_HALTED)
+            return 0;
+        if (action == VM_EXIT_CHECKPOINT) {
+            vm_stop(vm, cpu);
+            return VM_RUN_CHECKPOINT;
+        }
+
+        serial_flush(&vm->serial);
+        pthread_mutex_lock(&vm->dump_lock);
+        vm_dump(cpu);
+        pthread_mutex_unlock(&vm->dump_lock);
+        goto fail;
+    }
+
+    vm_stop(vm, cpu);
+    if (serial_flush(&vm->serial) < 0)
+        return -1;
+
+    // where every vCPU was when the limit hit
+    if (__atomic_load_n(&vm->limit_hit, __ATOMIC_ACQUIRE) != VM_LIMIT_NONE) {
+        pthread_mutex_lock(&vm->dump_lock);
+        vm_dump(cpu);
+        pthread_mutex_unlock(&vm->dump_lock);
+    }
+
+    return 0;
+
+fail:
+    vm_stop(vm, cpu);
+    return -1;
+}
+
+static void vm_pin_cpu(const struct vm_cpu *cpu) {
+    if (cpu->host_cpu < 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu->host_cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0)
+        fprintf(stderr, "pin vCPU %d to CPU %d: %s\n", cpu->id, cpu->host_cpu, strerror(err));
+}
+
+// vm_run under the cycle budget, if any.
+static int vm_run_limited(struct vm_cpu *cpu) {
+    struct vm_state *vm = cpu->vm;
+    int budget_fd = -1;
+    int r = -1;
+
+    timer_t profile_timer;
+    int profiling = 0;
+
+    signal_run = cpu->run;
+    cycles_exhausted = 0;
+    profile_requested = 0;
+    if (vm->cycle_budget && (budget_fd = vm_cpu_open_budget(cpu)) < 0)
+        vm_stop(vm, cpu);
+    else if (vm->profile_hz && !(profiling = vm_cpu_start_profile(cpu, &profile_timer) == 0))
+        vm_stop(vm, cpu);
+    else
+        r = vm_run(cpu);
+    signal_run = NULL;
+
+    if (profiling)
+        timer_delete(profile_timer);
+    if (budget_fd >= 0)
+        close(budget_fd);
+
+    pthread_mutex_lock(&vm->kick_lock);
+    cpu->exited = 1;
+    pthread_mutex_unlock(&vm->kick_lock);
+    return r;
+}
+
+static void *vm_cpu_thread(void *arg) {
+    struct vm_cpu *cpu = arg;
+    vm_pin_cpu(cpu);
+    return vm_run_limited(cpu) < 0 ? (void*)-1 : NULL;
+}
+
+// Runs vCPU 0 on the calling thread and the rest on threads of their own
+// until one of them stops the VM.
+static int vm_run_all(struct vm_state *vm) {
+    struct sigaction sa = {
+        .sa_handler = vm_kick_handler
+    };
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR2, &sa, NULL) < 0) {
+        perror("sigaction");
+        return -1;
+    }
+
+    if (vm->stats_format != VM_STATS_NONE) {
+        sa.sa_handler = vm_stats_signal_handler;
+        if (sigaction(SIGUSR1, &sa, NULL) < 0) {
+            perror("sigaction");
+            return -1;
+        }
+    }
+
+    if (vm->profile_hz) {
+        sa.sa_handler = vm_profile_signal_handler;
+        if (sigaction(SIGPROF, &sa, NULL) < 0) {
+            perror("sigaction");
+            return -1;
+        }
+    }
+
+    if (vm->cycle_budget) {
+        sa.sa_handler = vm_budget_signal_handler;
+        if (sigaction(SIGXCPU, &sa, NULL) < 0) {
+            perror("sigaction");
+            return -1;
+        }
+    }
+
+    if (vm_start_metrics(vm) < 0)
+        return -1;
+
+    if (uart_start(vm) < 0) {
+        vm_stop_metrics(vm);
+        return -1;
+    }
+
+    int result = 0;
+    vm->stop = 0;
+    vm->exit_status = 0;
+    vm->running_cpus = vm->cpu_count;
+    vm->limit_hit = VM_LIMIT_NONE;
+    for (size_t i = 0; i < vm->cpu_count; ++i) {
+        vm->cpus[i].thread = 0;
+        vm->cpus[i].exited = 0;
+    }
+    vm->cpus[0].thread = pthread_self();
+    for (size_t i = 1; i < vm->cpu_count; ++i) {
+        int err = pthread_create(&vm->cpus[i].thread, NULL, vm_cpu_thread, &vm->cpus[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            vm->cpus[i].thread = 0;
+            vm_stop(vm, &vm->cpus[0]);
+            result = -1;
+            break;
+        }
+    }
+
+    // started after the vCPU threads, they may have to stop them
+    int output_started = 0;
+    int queue_started = 0;
+    int deadline_started = 0;
+    if (result == 0) {
+        output_started = output_ring_start(vm) == 0;
+        queue_started = output_started && queue_start(vm) == 0;
+        deadline_started = queue_started && vm_start_deadline(vm) == 0;
+        if (!deadline_started) {
+            vm_stop(vm, &vm->cpus[0]);
+            result = -1;
+        }
+    }
+
+    vm_pin_cpu(&vm->cpus[0]);
+    if (result == 0)
+        result = vm_run_limited(&vm->cpus[0]);
+
+    for (size_t i = 1; i < vm->cpu_count; ++i) {
+        if (!vm->cpus[i].thread)
+            continue;
+        void *ret = NULL;
+        pthread_join(vm->cpus[i].thread, &ret);
+        if (ret != NULL)
+            result = -1;
+    }
+
+    if (deadline_started)
+        vm_stop_deadline(vm);
+    if (queue_started && queue_stop(vm) < 0)
+        result = -1;
+    if (output_started && output_ring_stop(vm) < 0)
+        result = -1;
+    if (__atomic_load_n(&vm->lazy.failed, __ATOMIC_ACQUIRE))
+        result = -1;
+    uart_stop(vm);
+    vm_stop_metrics(vm);
+    return result;
+}
+
+// Exit status of the last run, unless a limit stopped it.
+static int vm_status(const struct vm_state *vm) {
+    return vm->limit_hit != VM_LIMIT_NONE ? LIMIT_STATUS : vm->exit_status;
+}
+
+// Pages written since the last call, without clearing the log.
+static int vm_peek_dirty_log(struct vm_state *vm, const struct vm_region *region, uint64_t *bitmap) {
+    struct kvm_dirty_log log = {
+        .slot = region->slot,
+        .dirty_bitmap = bitmap
+    };
+
+    if (ioctl(vm->vm, KVM_GET_DIRTY_LOG, &log) < 0) {
+        perror("KVM_GET_DIRTY_LOG");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Pages written since the last call, write-protecting them again.
+static int vm_get_dirty_log(struct vm_state *vm, const struct vm_region *region, uint64_t *bitmap) {
+    if (vm_peek_dirty_log(vm, region, bitmap) < 0)
+        return -1;
+
+    // without manual protection KVM_GET_DIRTY_LOG clears it by itself
+    if (!vm->dirty_manual)
+        return 0;
+
+    struct kvm_clear_dirty_log clear = {
+        .slot = region->slot,
+        .num_pages = bytes_to_pages(region->size),
+        .first_page = 0,
+        .dirty_bitmap = bitmap
+    };
+
+    if (ioctl(vm->vm, KVM_CLEAR_DIRTY_LOG, &clear) < 0) {
+        perror("KVM_CLEAR_DIRTY_LOG");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int bitmap_test(const uint64_t *bitmap, size_t bit) {
+    return (bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+#define DIRTY_BITMAP_MAGIC "BVMDIRTY"
+#define DIRTY_PAGES_MAGIC "BVMPAGES"
+
+// Appends the pages the guest wrote since boot (or the checkpoint) to the -d file: a bitmap
+// per memory slot or the pages themselves with their addresses. A summary goes to stderr.
+static int vm_dirty_report(struct vm_state *vm, const char *when) {
+    if (vm->dirty_format == VM_DIRTY_NONE)
+        return 0;
+
+    size_t max_pages = 0;
+    for (size_t i = 0; i < vm->region_count; ++i) {
+        if (bytes_to_pages(vm->regions[i].size) > max_pages)
+            max_pages = bytes_to_pages(vm->regions[i].size);
+    }
+
+    const size_t words = (max_pages + 63) / 64;
+    uint64_t *bitmap = calloc(words ? words : 1, sizeof(uint64_t));
+    if (!bitmap) {
+        perror("malloc");
+        return -1;
+    }
+
+    // both record kinds start with the magic, page size and a count
+    uint64_t header[3] = { 0, PAGE_SIZE, 0 };
+    memcpy(header, vm->dirty_format == VM_DIRTY_BITMAP ? DIRTY_BITMAP_MAGIC : DIRTY_PAGES_MAGIC, 8);
+    const off_t header_pos = lseek(vm->dirty_fd, 0, SEEK_END);
+    int r = header_pos < 0 || write_full(vm->dirty_fd, header, sizeof(header)) < 0 ? -1 : 0;
+
+    size_t dirty = 0, total = 0;
+    uint64_t records = 0;
+    for (size_t i = 0; i < vm->region_count && r == 0; ++i) {
+        const struct vm_region *region = &vm->regions[i];
+        if (!(region->flags & KVM_MEM_LOG_DIRTY_PAGES))
+            continue;
+
+        const size_t pages = bytes_to_pages(region->size);
+        memset(bitmap, 0, words * sizeof(uint64_t));
+        if (vm_peek_dirty_log(vm, region, bitmap) < 0) {
+            r = -1;
+            break;
+        }
+
+        size_t region_dirty = 0;
+        for (size_t page = 0; page < pages; ++page)
+            region_dirty += bitmap_test(bitmap, page);
+        dirty += region_dirty;
+        total += pages;
+
+        if (vm->dirty_format == VM_DIRTY_BITMAP) {
+            const uint64_t region_header[2] = { region->guest_addr, region->size };
+            if (write_full(vm->dirty_fd, region_header, sizeof(region_header)) < 0 ||
+                    write_full(vm->dirty_fd, bitmap, (pages + 63) / 64 * sizeof(uint64_t)) < 0)
+                r = -1;
+            ++records;
+            continue;
+        }
+
+        for (size_t page = 0; page < pages && r == 0; ++page) {
+            if (!bitmap_test(bitmap, page))
+                continue;
+            const uint64_t addr = region->guest_addr + page * PAGE_SIZE;
+            if (write_full(vm->dirty_fd, &addr, sizeof(addr)) < 0 ||
+                    write_full(vm->dirty_fd, (const uint8_t*)region->host + page * PAGE_SIZE, PAGE_SIZE) < 0)
+                r = -1;
+            ++records;
+        }
+    }
+
+    // the count is only known now
+    if (r == 0 && pwrite(vm->dirty_fd, &records, sizeof(records), header_pos + 2 * sizeof(uint64_t)) != sizeof(records))
+        r = -1;
+    if (r < 0)
+        perror("write dirty report");
+
+    fprintf(stderr, "Dirty pages at %s: %zu of %zu (%zu KiB)\n", when, dirty, total, dirty * PAGE_SIZE / 1024);
+    free(bitmap);
+    return r;
+}
+
+// KVM finishes a port access on the next KVM_RUN. Do it now without entering
+// the guest, so that the vCPU state can be saved or replaced.
+static int vm_cpu_complete_io(struct vm_cpu *cpu) {
+    __atomic_store_n(&cpu->run->immediate_exit, 1, __ATOMIC_RELEASE);
+    int r = ioctl(cpu->fd, KVM_RUN, 0);
+    __atomic_store_n(&cpu->run->immediate_exit, 0, __ATOMIC_RELEASE);
+    vm_cpu_exited(cpu);
+
+    if (r == 0 || errno != EINTR) {
+        perror("KVM_RUN complete I/O");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int vm_cpu_save_state(struct vm_cpu *cpu, struct vm_cpu_state *state) {
+    const struct kvm_regs *regs = vm_cpu_regs(cpu);
+    const struct kvm_sregs *sregs = vm_cpu_sregs(cpu);
+    if (!regs || !sregs)
+        return -1;
+    state->regs = *regs;
+    state->sregs = *sregs;
+
+    if (ioctl(cpu->fd, KVM_GET_FPU, &state->fpu) < 0) {
+        perror("KVM_GET_FPU");
+        return -1;
+    }
+
+    if (ioctl(cpu->fd, KVM_GET_VCPU_EVENTS, &state->events) < 0) {
+        perror("KVM_GET_VCPU_EVENTS");
+        return -1;
+    }
+
+    memset(&state->xcrs, 0, sizeof(state->xcrs));
+    if (ioctl(cpu->vm->kvm, KVM_CHECK_EXTENSION, KVM_CAP_XCRS) > 0) {
+        if (ioctl(cpu->fd, KVM_GET_XCRS, &state->xcrs) < 0) {
+            perror("KVM_GET_XCRS");
+            return -1;
+        }
+        if (ioctl(cpu->fd, KVM_GET_XSAVE, &state->xsave) < 0) {
+            perror("KVM_GET_XSAVE");
+            return -1;
+        }
+    }
+
+    state->msrs = calloc(1, sizeof(struct kvm_msrs) + SNAPSHOT_MSR_COUNT * sizeof(struct kvm_msr_entry));
+    if (!state->msrs) {
+        perror("malloc");
+        return -1;
+    }
+
+    // not every host has every MSR, keep the ones that can be read
+    for (size_t i = 0; i < SNAPSHOT_MSR_COUNT; ++i) {
+        struct kvm_msr_entry *entry = &state->msrs->entries[state->msrs->nmsrs];
+        struct {
+            struct kvm_msrs header;
+            struct kvm_msr_entry entry;
+        } one = { .header = { .nmsrs = 1 }, .entry = { .index = snapshot_msrs[i] } };
+
+        if (ioctl(cpu->fd, KVM_GET_MSRS, &one) == 1) {
+            *entry = one.entry;
+            ++state->msrs->nmsrs;
+        }
+    }
+
+    return 0;
+}
+
+static int vm_cpu_load_state(struct vm_cpu *cpu, const struct vm_cpu_state *state) {
+    vm_cpu_drop_regs(cpu);
+    if (ioctl(cpu->fd, KVM_SET_SREGS, &state->sregs) < 0) {
+        perror("KVM_SET_SREGS");
+        return -1;
+    }
+
+    if (ioctl(cpu->fd, KVM_SET_REGS, &state->regs) < 0) {
+        perror("KVM_SET_REGS");
+        return -1;
+    }
+
+    if (ioctl(cpu->fd, KVM_SET_FPU, &state->fpu) < 0) {
+        perror("KVM_SET_FPU");
+        return -1;
+    }
+
+    // XCR0 first, it decides which parts of the XSAVE area are loaded
+    if (state->xcrs.nr_xcrs && ioctl(cpu->fd, KVM_SET_XCRS, &state->xcrs) < 0) {
+        perror("KVM_SET_XCRS");
+        return -1;
+    }
+
+    if (state->xcrs.nr_xcrs && ioctl(cpu->fd, KVM_SET_XSAVE, &state->xsave) < 0) {
+        perror("KVM_SET_XSAVE");
+        return -1;
+    }
+
+    if (ioctl(cpu->fd, KVM_SET_VCPU_EVENTS, &state->events) < 0) {
+        perror("KVM_SET_VCPU_EVENTS");
+        return -1;
+    }
+
+    if (ioctl(cpu->fd, KVM_SET_MSRS, state->msrs) != (int)state->msrs->nmsrs) {
+        perror("KVM_SET_MSRS");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Unpacking shares out chunks between threads, chunks of extent i start at first_chunk[i]
+struct packed_unpack {
+    struct vm_state *vm;
+    uint8_t *hosts[VM_MAX_REGIONS];
+    int fresh[VM_MAX_REGIONS];  // just mapped and still zero, zero chunks are skipped
+    size_t first_chunk[VM_MAX_REGIONS + 1];
+    size_t next;
+    int failed;
+};
+
+static void *packed_unpack_thread(void *arg) {
+    struct packed_unpack *unpack = arg;
+    const struct packed_image *image = unpack->vm->packed;
+    const uint64_t chunk_size = image->header.chunk_size;
+    const uLong bound = compressBound(chunk_size);
+
+    uint8_t *buf = malloc(bound);
+    if (!buf) {
+        perror("malloc");
+        __atomic_store_n(&unpack->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    size_t c;
+    while ((c = __atomic_fetch_add(&unpack->next, 1, __ATOMIC_RELAXED)) < image->header.chunk_count &&
+            !__atomic_load_n(&unpack->failed, __ATOMIC_RELAXED)) {
+        size_t e = 0;
+        while (unpack->first_chunk[e + 1] <= c)
+            ++e;
+
+        const struct packed_chunk *chunk = &image->chunks[c];
+        const uint64_t offset = (c - unpack->first_chunk[e]) * chunk_size;
+        const uint64_t left = image->extents[e].size - offset;
+        const size_t len = left < chunk_size ? left : chunk_size;
+        uint8_t *dst = unpack->hosts[e] + offset;
+
+        int ok = 0;
+        uLongf out = len;
+        switch (chunk->encoding) {
+        case PACKED_ZERO:
+            if (!unpack->fresh[e])
+                memset(dst, 0, len);
+            ok = 1;
+            break;
+        case PACKED_RAW:
+            ok = chunk->size == len && pread_full(image->fd, dst, len, chunk->offset) == 0;
+            break;
+        case PACKED_DEFLATE:
+            // straight into guest memory
+            ok = chunk->size <= bound && pread_full(image->fd, buf, chunk->size, chunk->offset) == 0 &&
+                uncompress(dst, &out, buf, chunk->size) == Z_OK && out == len;
+            break;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "Bad chunk %zu of packed image\n", c);
+            __atomic_store_n(&unpack->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// Unpacks the image opened by vm_load_image with a thread per host CPU over the memory
+// vm_prepare_to_boot set up, and gives the vCPU the state the image was written with.
+static int vm_unpack_image(struct vm_state *vm) {
+    struct packed_image *image = vm->packed;
+    if (!image)
+        return 0;
+
+    pthread_t threads[PACKED_MAX_THREADS];
+    size_t thread_count = 0;
+    struct packed_unpack *unpack = calloc(1, sizeof(struct packed_unpack));
+    if (!unpack) {
+        perror("malloc");
+        goto fail;
+    }
+
+    if (vm->cpu_count != 1) {
+        fprintf(stderr, "Packed image holds the state of a single vCPU\n");
+        goto fail;
+    }
+
+    unpack->vm = vm;
+    for (size_t e = 0; e < image->header.extent_count; ++e) {
+        const struct packed_extent *extent = &image->extents[e];
+        unpack->first_chunk[e + 1] = unpack->first_chunk[e] +
+            (extent->size + image->header.chunk_size - 1) / image->header.chunk_size;
+
+        for (size_t i = 0; i < vm->region_count && !unpack->hosts[e]; ++i) {
+            const struct vm_region *region = &vm->regions[i];
+            const int in_mem = (uint8_t*)region->host >= (uint8_t*)vm->mem &&
+                (uint8_t*)region->host < (uint8_t*)vm->mem + vm->mem_size;
+            if ((in_mem || region->host == vm->page_table) && extent->guest_addr >= region->guest_addr &&
+                    extent->guest_addr + extent->size <= region->guest_addr + region->size) {
+                unpack->hosts[e] = (uint8_t*)region->host + (extent->guest_addr - region->guest_addr);
+                unpack->fresh[e] = in_mem;
+            }
+        }
+
+        if (!unpack->hosts[e]) {
+            fprintf(stderr, "Packed image memory at 0x%llx doesn't fit the VM, run it with the options it was written with\n",
+                (unsigned long long)extent->guest_addr);
+            goto fail;
+        }
+    }
+
+    cpu_set_t cpus;
+    size_t want = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : 1;
+    if (want > PACKED_MAX_THREADS)
+        want = PACKED_MAX_THREADS;
+    if (want > image->header.chunk_count)
+        want = image->header.chunk_count;
+
+    // this thread is one of them, fewer threads only make it slower
+    for (; thread_count + 1 < want; ++thread_count) {
+        if (pthread_create(&threads[thread_count], NULL, packed_unpack_thread, unpack) != 0)
+            break;
+    }
+    packed_unpack_thread(unpack);
+    for (size_t i = 0; i < thread_count; ++i)
+        pthread_join(threads[i], NULL);
+
+    if (unpack->failed || vm_cpu_load_state(&vm->cpus[0], &image->cpu) < 0)
+        goto fail;
+
+    vm->resumed = 1;
+    free(unpack);
+    packed_image_free(image);
+    vm->packed = NULL;
+    return 0;
+
+fail:
+    free(unpack);
+    packed_image_free(image);
+    vm->packed = NULL;
+    return -1;
+}
+
+static int mem_is_zero(const void *data, size_t len) {
+    const uint64_t *words = data;
+    for (size_t i = 0; i < len / sizeof(uint64_t); ++i) {
+        if (words[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+// Writes guest RAM and the page table with the vCPU state saved at the checkpoint
+// as a packed image. A chunk is deflated, kept raw if that doesn't make it smaller,
+// or left out if it is all zeroes.
+static int vm_write_packed(struct vm_state *vm, const char *path) {
+    const struct vm_cpu_state *state = &vm->snapshot->cpu;
+    struct packed_header header = {
+        .version = PACKED_VERSION,
+        .chunk_size = PACKED_CHUNK_SIZE,
+        .msr_count = state->msrs->nmsrs
+    };
+    memcpy(header.magic, PACKED_MAGIC, 8);
+
+    struct packed_extent extents[VM_MAX_REGIONS];
+    const uint8_t *hosts[VM_MAX_REGIONS];
+    for (size_t i = 0; i < vm->region_count; ++i) {
+        const struct vm_region *region = &vm->regions[i];
+        const int in_mem = (uint8_t*)region->host >= (uint8_t*)vm->mem &&
+            (uint8_t*)region->host < (uint8_t*)vm->mem + vm->mem_size;
+        // files are mapped again from their paths
+        if (!in_mem && region->host != vm->page_table)
+            continue;
+
+        extents[header.extent_count].guest_addr = region->guest_addr;
+        extents[header.extent_count].size = region->size;
+        hosts[header.extent_count++] = region->host;
+        header.chunk_count += (region->size + PACKED_CHUNK_SIZE - 1) / PACKED_CHUNK_SIZE;
+    }
+
+    const struct packed_cpu cpu = {
+        .regs = state->regs,
+        .sregs = state->sregs,
+        .fpu = state->fpu,
+        .events = state->events,
+        .xcrs = state->xcrs,
+        .xsave = state->xsave
+    };
+
+    const uLong bound = compressBound(PACKED_CHUNK_SIZE);
+    struct packed_chunk *chunks = calloc(header.chunk_count ? header.chunk_count : 1, sizeof(struct packed_chunk));
+    uint8_t *buf = malloc(bound);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (!chunks || !buf || fd < 0) {
+        perror(fd < 0 ? "open packed image" : "malloc");
+        goto fail;
+    }
+
+    const off_t index_pos = sizeof(header) + sizeof(cpu) + header.msr_count * sizeof(struct kvm_msr_entry) +
+        header.extent_count * sizeof(struct packed_extent);
+    off_t pos = index_pos + header.chunk_count * sizeof(struct packed_chunk);
+    if (write_full(fd, &header, sizeof(header)) < 0 || write_full(fd, &cpu, sizeof(cpu)) < 0 ||
+            write_full(fd, state->msrs->entries, header.msr_count * sizeof(struct kvm_msr_entry)) < 0 ||
+            write_full(fd, extents, header.extent_count * sizeof(struct packed_extent)) < 0 ||
+            lseek(fd, pos, SEEK_SET) < 0)
+        goto write_fail;
+
+    size_t c = 0;
+    uint64_t memory = 0;
+    for (size_t e = 0; e < header.extent_count; ++e) {
+        for (uint64_t offset = 0; offset < extents[e].size; offset += PACKED_CHUNK_SIZE, ++c) {
+            const uint64_t left = extents[e].size - offset;
+            const size_t len = left < PACKED_CHUNK_SIZE ? left : PACKED_CHUNK_SIZE;
+            const uint8_t *data = hosts[e] + offset;
+            memory += len;
+            if (mem_is_zero(data, len)) {
+                chunks[c].encoding = PACKED_ZERO;
+                continue;
+            }
+
+            uLongf packed = bound;
+            chunks[c].encoding = PACKED_RAW;
+            chunks[c].size = len;
+            if (compress2(buf, &packed, data, len, Z_BEST_SPEED) == Z_OK && packed < len) {
+                chunks[c].encoding = PACKED_DEFLATE;
+                chunks[c].size = packed;
+                data = buf;
+            }
+
+            chunks[c].offset = pos;
+            if (write_full(fd, data, chunks[c].size) < 0)
+                goto write_fail;
+            pos += chunks[c].size;
+        }
+    }
+
+    if (lseek(fd, index_pos, SEEK_SET) < 0 || write_full(fd, chunks, header.chunk_count * sizeof(struct packed_chunk)) < 0)
+        goto write_fail;
+
+    fprintf(stderr, "Packed image %s: %llu KiB of memory in %llu KiB\n", path,
+        (unsigned long long)memory / 1024, (unsigned long long)pos / 1024);
+    close(fd);
+    free(buf);
+    free(chunks);
+    return 0;
+
+write_fail:
+    perror("write packed image");
+fail:
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    free(chunks);
+    return -1;
+}
+
+// Saves the state of the (single) vCPU and the memory it has written so far.
+static int vm_snapshot_save(struct vm_state *vm) {
+    struct vm_cpu *cpu = &vm->cpus[0];
+    struct vm_snapshot *snapshot = calloc(1, sizeof(struct vm_snapshot));
+    if (!snapshot) {
+        perror("malloc");
+        return -1;
+    }
+    vm->snapshot = snapshot;
+
+    // the saved RIP has to be past the checkpoint port write
+    if (vm_cpu_complete_io(cpu) < 0)
+        goto fail;
+
+    if (vm_cpu_save_state(cpu, &snapshot->cpu) < 0)
+        goto fail;
+
+    size_t max_pages = 0;
+    for (size_t i = 0; i < vm->region_count; ++i) {
+        if (bytes_to_pages(vm->regions[i].size) > max_pages)
+            max_pages = bytes_to_pages(vm->regions[i].size);
+    }
+
+    snapshot->dirty = calloc((max_pages + 63) / 64, sizeof(uint64_t));
+    if (!snapshot->dirty) {
+        perror("malloc");
+        goto fail;
+    }
+
+    const uint64_t image_end = vm->image_size ? vm->image_size : vm->image_loaded;
+    for (size_t i = 0; i < vm->region_count; ++i) {
+        const struct vm_region *region = &vm->regions[i];
+        // read-only files can't change
+        if (!(region->flags & KVM_MEM_LOG_DIRTY_PAGES))
+            continue;
+
+        snapshot->mem[i] = mmap(NULL, region->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (snapshot->mem[i] == MAP_FAILED) {
+            perror("mmap snapshot");
+            goto fail;
         }
-    } else if (exit_reason == KVM_EXIT_MMIO) {
-        if (vm->run->mmio.is_write) {
-            fprintf(stderr, "Write %u bytes at %016llx: ",
-                vm->run->mmio.len, vm->run->mmio.phys_addr);
-            for (size_t i = 0; i < vm->run->mmio.len; ++i)
-                fprintf(stderr, "%02x ", vm->run->mmio.data[i]);
-            fprintf(stderr, "\n\n");
+
+        if (vm_get_dirty_log(vm, region, snapshot->dirty) < 0)
+            goto fail;
+
+        // KVM only logs guest writes, the image and page table didn't come from the guest
+        for (size_t page = 0; page < bytes_to_pages(region->size); ++page) {
+            const uint64_t offset = page * PAGE_SIZE;
+            if (!bitmap_test(snapshot->dirty, page) && region->host != vm->page_table &&
+                    region->guest_addr + offset >= image_end)
+                continue;
+
+            size_t len = region->size - offset < PAGE_SIZE ? region->size - offset : PAGE_SIZE;
+            memcpy((uint8_t*)snapshot->mem[i] + offset, (const uint8_t*)region->host + offset, len);
+        }
+    }
+
+    if (vm->lazy.fd >= 0)
+        __atomic_store_n(&vm->lazy.source, &page_source_snapshot, __ATOMIC_RELEASE);
+    return 0;
+
+fail:
+    vm_snapshot_free(vm);
+    return -1;
+}
+
+// Returns the VM to the checkpoint, copying back only the pages written since then.
+// With -u they are dropped instead and filled from the snapshot when touched again.
+static int vm_snapshot_restore(struct vm_state *vm) {
+    struct vm_cpu *cpu = &vm->cpus[0];
+    struct vm_snapshot *snapshot = vm->snapshot;
+
+    // drop the port read the last run stopped at
+    if (vm_cpu_complete_io(cpu) < 0)
+        return -1;
+
+    for (size_t i = 0; i < vm->region_count; ++i) {
+        const struct vm_region *region = &vm->regions[i];
+        if (!(region->flags & KVM_MEM_LOG_DIRTY_PAGES))
+            continue;
+        if (vm_get_dirty_log(vm, region, snapshot->dirty) < 0)
+            return -1;
+
+        const int lazy = vm->lazy.fd >= 0 && region->host >= vm->mem &&
+            (uint8_t*)region->host < (uint8_t*)vm->mem + vm->mem_size;
+        const size_t pages = bytes_to_pages(region->size);
+        for (size_t page = 0; page < pages; ++page) {
+            if (!bitmap_test(snapshot->dirty, page))
+                continue;
+
+            const uint64_t offset = page * PAGE_SIZE;
+            if (lazy) {
+                size_t count = 1;
+                while (page + count < pages && bitmap_test(snapshot->dirty, page + count))
+                    ++count;
+                if (madvise((uint8_t*)region->host + offset, count * PAGE_SIZE, MADV_DONTNEED) < 0) {
+                    perror("madvise MADV_DONTNEED");
+                    return -1;
+                }
+                page += count - 1;
+                continue;
+            }
+
+            size_t len = region->size - offset < PAGE_SIZE ? region->size - offset : PAGE_SIZE;
+            memcpy((uint8_t*)region->host + offset, (const uint8_t*)snapshot->mem[i] + offset, len);
+        }
+    }
+
+    return vm_cpu_load_state(cpu, &snapshot->cpu);
+}
+
+// Fork-server mode: boot once up to the checkpoint, then run the rest of the guest
+// once per input, each time starting from the saved state. Returns -1 if any run failed,
+// otherwise the last non-zero exit status of the guest.
+static int vm_serve_snapshot(struct vm_state *vm, char **inputs, size_t input_count) {
+    // a packed image starts at its checkpoint
+    int result = vm->resumed ? VM_RUN_CHECKPOINT : vm_run_all(vm);
+    vm->wait_checkpoint = 0;
+    if (result < 0)
+        return -1;
+    if (result != VM_RUN_CHECKPOINT) {
+        fprintf(stderr, "Guest stopped before reaching the checkpoint\n");
+        return -1;
+    }
+
+    // saving clears the log, every input's report only has what it wrote
+    if (vm_dirty_report(vm, "checkpoint") < 0 || vm_snapshot_save(vm) < 0)
+        return -1;
+    if (vm->packed_path && vm_write_packed(vm, vm->packed_path) < 0)
+        return -1;
+
+    result = 0;
+    for (size_t i = 0; i < input_count; ++i) {
+        if (i > 0 && vm_snapshot_restore(vm) < 0)
+            return -1;
+
+        int fd = open(inputs[i], O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "open %s: %s\n", inputs[i], strerror(errno));
+            result = -1;
+            continue;
+        }
+
+        serial_reset_input(&vm->serial, fd);
+        if (vm_run_all(vm) < 0) {
+            fprintf(stderr, "%s: guest failed\n", inputs[i]);
+            result = -1;
+        } else if (vm_status(vm) != 0 && result >= 0) {
+            result = vm_status(vm);
+        }
+        if (vm_dirty_report(vm, inputs[i]) < 0)
+            result = -1;
+        close(fd);
+    }
+
+    return result;
+}
+
+// Returns the guest's exit status or -1 on failure.
+static int execute_image(const char *path, const struct vm_options *options, char **inputs, size_t input_count) {
+    struct vm_state *vm = vm_create(options);
+    if (!vm || vm_setup_devices(vm) < 0)
+        goto fail;
+
+    serial_init(&vm->serial, STDIN_FILENO, STDOUT_FILENO,
+        options->line_buffered || isatty(STDOUT_FILENO) ? SERIAL_FLUSH_LINE : SERIAL_FLUSH_FULL);
+
+    if (vm_load_image(vm, path, options) < 0)
+        goto fail;
+
+    if (vm_register_mem(vm, options) < 0)
+        goto fail;
+
+    if (vm_prepare_to_boot(vm, options) < 0 || vm_unpack_image(vm) < 0)
+        goto fail;
+
+    int result = options->snapshot ? vm_serve_snapshot(vm, inputs, input_count) : vm_run_all(vm);
+    vm_stats_report(vm);
+    vm_profile_report(vm);
+    if (!options->snapshot && vm_dirty_report(vm, "exit") < 0)
+        result = -1;
+    if (input_log_close(&vm->input_log) < 0)
+        result = -1;
+    if (result < 0)
+        goto fail;
+
+    if (!options->snapshot)
+        result = vm_status(vm);
+
+    vm_free(vm);
+    return result;
+
+fail:
+    vm_free(vm);
+    return -1;
+}
+
+static int parse_num(const char *s, size_t *out) {
+    if (s == NULL || *s == '\0')
+        return -1;
+
+    char *end = 0;
+    errno = 0;
+    uint64_t num = strtoull(s, &end, 0);
+    if (errno != 0)
+        return -1;
+
+    unsigned shift = 0;
+    switch (*end) {
+    case 'K': case 'k': shift = 10; ++end; break;
+    case 'M': case 'm': shift = 20; ++end; break;
+    case 'G': case 'g': shift = 30; ++end; break;
+    }
+
+    if (*end != '\0')
+        return -1;
+
+    if (num > (UINT64_MAX >> shift))
+        return -1;
+    num <<= shift;
+
+    if (num > SIZE_MAX)
+        return -1;
+
+    *out = (size_t)num;
+    return 0;
+}
+
+// Parses a list like "0-3,8,10" into out.
+static int parse_list(const char *s, int *out, size_t max, size_t *count) {
+    *count = 0;
+    while (s && *s) {
+        char *end = NULL;
+        errno = 0;
+        long first = strtol(s, &end, 10);
+        long last = first;
+        if (errno != 0 || end == s || first < 0)
+            return -1;
+
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (errno != 0 || end == s || last < first)
+                return -1;
+        }
+
+        for (long i = first; i <= last; ++i) {
+            if (*count == max)
+                return -1;
+            out[(*count)++] = i;
+        }
+
+        if (*end == ',')
+            ++end;
+        else if (*end != '\0')
+            return -1;
+        s = end;
+    }
+
+    return *count > 0 ? 0 : -1;
+}
+
+// Brings a VM that already ran a job back to the state it had right after vm_create,
+// keeping the KVM fds and vCPUs. Guest memory is replaced by a fresh mapping, which
+// drops the guest's writes and a zero-copy image in one go.
+static int vm_reset(struct vm_state *vm, const struct vm_options *options) {
+    for (size_t i = 0; i < vm->cpu_count; ++i) {
+        if (vm_cpu_complete_io(&vm->cpus[i]) < 0)
+            return -1;
+    }
+
+    for (size_t i = 0; i < vm->region_count; ++i) {
+        struct kvm_userspace_memory_region region = {
+            .slot = vm->regions[i].slot
+        };
+
+        if (ioctl(vm->vm, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
+            perror("KVM_SET_USER_MEMORY_REGION delete");
+            return -1;
+        }
+    }
+    vm->region_count = 0;
+    vm_unmap_files(vm);
+
+    if (vm->page_table != MAP_FAILED) {
+        munmap(vm->page_table, vm->page_table_size);
+        vm->page_table = MAP_FAILED;
+        vm->page_table_size = 0;
+    }
+
+    if (vm_alloc_mem(vm->mem, vm->mem_size, options) == MAP_FAILED)
+        return -1;
+    vm->image_size = 0;
+    vm->image_loaded = 0;
+
+    if (vm_bind_mem(vm, options) < 0)
+        return -1;
+
+    if (options->mem_prefault)
+        vm_prefault_mem(vm, options);
+
+    // a failed job may leave console output nobody can receive anymore
+    if (vm->console_ring)
+        vm->console_ring->first = vm->console_ring->last;
+
+    vm->stop = 0;
+    vm->wait_checkpoint = 0;
+    vm->resumed = 0;
+
+    for (size_t i = 0; i < vm->cpu_count; ++i) {
+        if (vm_cpu_load_state(&vm->cpus[i], &vm->reset_state[i]) < 0)
+            return -1;
+        memset(&vm->cpus[i].stats, 0, sizeof(vm->cpus[i].stats));
+        struct vm_profile *profile = &vm->cpus[i].profile;
+        if (profile->entries)
+            memset(profile->entries, 0, profile->capacity * sizeof(struct vm_profile_entry));
+        profile->used = 0;
+        profile->samples = 0;
+    }
+
+    return 0;
+}
+
+#define VM_POOL_MAX 64
+
+// Idle VMs of the server, ready to take the next job
+struct vm_pool {
+    pthread_mutex_t lock;
+    struct vm_state *vms[VM_POOL_MAX];
+    size_t count;
+};
+
+static struct vm_state *vm_pool_create(const struct vm_options *options) {
+    struct vm_state *vm = vm_create(options);
+    if (!vm)
+        return NULL;
+    if (vm_setup_devices(vm) < 0)
+        goto fail;
+
+    serial_init(&vm->serial, -1, -1, SERIAL_FLUSH_FULL);
+
+    vm->reset_state = calloc(vm->cpu_count, sizeof(struct vm_cpu_state));
+    if (!vm->reset_state) {
+        perror("malloc");
+        goto fail;
+    }
+
+    for (size_t i = 0; i < vm->cpu_count; ++i) {
+        if (vm_cpu_save_state(&vm->cpus[i], &vm->reset_state[i]) < 0)
+            goto fail;
+    }
+
+    return vm;
+
+fail:
+    vm_free(vm);
+    return NULL;
+}
+
+// Takes an idle VM with the right amount of memory, creates one if there is none.
+static struct vm_state *vm_pool_get(struct vm_pool *pool, const struct vm_options *options) {
+    const size_t mem_size = vm_aligned_mem_size(options);
+    struct vm_state *vm = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < pool->count; ++i) {
+        if (pool->vms[i]->mem_size == mem_size) {
+            vm = pool->vms[i];
+            pool->vms[i] = pool->vms[--pool->count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return vm ? vm : vm_pool_create(options);
+}
+
+// Resets the VM right away, so the next job doesn't wait for it.
+static void vm_pool_put(struct vm_pool *pool, struct vm_state *vm, const struct vm_options *options) {
+    if (vm_reset(vm, options) < 0) {
+        vm_free(vm);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count < VM_POOL_MAX) {
+        pool->vms[pool->count++] = vm;
+        vm = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    vm_free(vm);
+}
+
+#define VM_JOB_MAX 4096
+
+struct vm_server {
+    int fd;
+    const struct vm_options *options;
+    struct vm_pool pool;
+};
+
+// What a job names besides VM options. Input, expected output and status only come from a batch manifest.
+struct vm_job {
+    const char *image;
+    const char *input;
+    const char *expect;
+    size_t status;
+};
+
+// Job text is "mode=L mem=1M entry=0x1000 pt=0x2000 image=/path/to/image", every key but
+// image is optional and defaults to the server options. The image path goes to the end.
+// A batch job may add "input=path expect=path status=N" before the image.
+static int vm_parse_job(char *s, struct vm_options *options, struct vm_job *job, int batch) {
+    job->image = NULL;
+    while (*s) {
+        if (*s == ' ') {
+            ++s;
+            continue;
+        }
+
+        if (strncmp(s, "image=", 6) == 0) {
+            job->image = s + 6;
+            break;
+        }
+
+        char *end = strchr(s, ' ');
+        if (end)
+            *end++ = '\0';
+        else
+            end = s + strlen(s);
+
+        if (strcmp(s, "mode=R") == 0) {
+            options->mode = VM_MODE_REAL;
+        } else if (strcmp(s, "mode=P") == 0) {
+            options->mode = VM_MODE_PROTECTED;
+        } else if (strcmp(s, "mode=L") == 0) {
+            options->mode = VM_MODE_LONG;
+        } else if (strncmp(s, "mem=", 4) == 0) {
+            if (parse_num(s + 4, &options->mem_size) < 0 || options->mem_size == 0)
+                return -1;
+        } else if (strncmp(s, "entry=", 6) == 0) {
+            if (parse_num(s + 6, &options->entry_point) < 0)
+                return -1;
+        } else if (strncmp(s, "pt=", 3) == 0) {
+            if (parse_num(s + 3, &options->page_table) < 0)
+                return -1;
+            options->page_table_is_set = 1;
+        } else if (batch && strncmp(s, "input=", 6) == 0) {
+            job->input = s + 6;
+        } else if (batch && strncmp(s, "expect=", 7) == 0) {
+            job->expect = s + 7;
+        } else if (batch && strncmp(s, "status=", 7) == 0) {
+            if (parse_num(s + 7, &job->status) < 0)
+                return -1;
         } else {
-            fprintf(stderr, "Read %u bytes at %016llx\n\n",
-                vm->run->mmio.len, vm->run->mmio.phys_addr);
+            return -1;
+        }
+        s = end;
+    }
+
+    return job->image && *job->image ? 0 : -1;
+}
+
+// Receives one job: its text and the guest's stdin and stdout as SCM_RIGHTS.
+static int vm_recv_job(int conn, char *text, int fds[2]) {
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {
+        .iov_base = text,
+        .iov_len = VM_JOB_MAX
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+
+    ssize_t len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (len < 0) {
+        perror("recvmsg job");
+        return -1;
+    }
+    text[len] = '\0';
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        fprintf(stderr, "Job without stdin and stdout\n");
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        fprintf(stderr, "Job is too long\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Stops the guest of a job whose client went away, so a killed client doesn't keep the worker busy.
+struct vm_job_watch {
+    struct vm_state *vm;
+    int conn;
+    int stop_fd;
+    int hung_up;
+    pthread_t thread;
+};
+
+static void *vm_job_watch_thread(void *arg) {
+    struct vm_job_watch *watch = arg;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    struct pollfd fds[2] = {
+        { .fd = watch->conn, .events = POLLRDHUP },
+        { .fd = watch->stop_fd, .events = POLLIN }
+    };
+    while (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR) {
+            perror("poll job connection");
+            return NULL;
+        }
+    }
+
+    if (!fds[1].revents && (fds[0].revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+        fprintf(stderr, "Client went away, stopping its job\n");
+        __atomic_store_n(&watch->hung_up, 1, __ATOMIC_RELEASE);
+        vm_stop(watch->vm, NULL);
+    }
+    return NULL;
+}
+
+static int vm_job_watch_start(struct vm_job_watch *watch, struct vm_state *vm, int conn) {
+    watch->vm = vm;
+    watch->conn = conn;
+    watch->hung_up = 0;
+    watch->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (watch->stop_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    int err = pthread_create(&watch->thread, NULL, vm_job_watch_thread, watch);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        close(watch->stop_fd);
+        watch->stop_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns 1 if the client went away while the job ran.
+static int vm_job_watch_stop(struct vm_job_watch *watch) {
+    const uint64_t one = 1;
+    if (write(watch->stop_fd, &one, sizeof(one)) != sizeof(one))
+        perror("write eventfd");
+    pthread_join(watch->thread, NULL);
+    close(watch->stop_fd);
+    watch->stop_fd = -1;
+    return __atomic_load_n(&watch->hung_up, __ATOMIC_ACQUIRE);
+}
+
+static int vm_serve_job(struct vm_server *server, int conn) {
+    char text[VM_JOB_MAX + 1];
+    int fds[2] = { -1, -1 };
+    struct vm_options options = *server->options;
+    struct vm_state *vm = NULL;
+    struct vm_job job = {};
+    struct vm_job_watch watch;
+    int hung_up = 0;
+    int status = 1;
+
+    if (vm_recv_job(conn, text, fds) < 0)
+        goto reply;
+
+    if (vm_parse_job(text, &options, &job, 0) < 0) {
+        fprintf(stderr, "Bad job: %s\n", text);
+        goto reply;
+    }
+
+    vm = vm_pool_get(&server->pool, &options);
+    if (!vm)
+        goto reply;
+
+    serial_attach(&vm->serial, fds[0], fds[1],
+        options.line_buffered || isatty(fds[1]) ? SERIAL_FLUSH_LINE : SERIAL_FLUSH_FULL);
+
+    if (vm_load_image(vm, job.image, &options) < 0)
+        goto reply;
+
+    if (vm_register_mem(vm, &options) < 0)
+        goto reply;
+
+    if (vm_prepare_to_boot(vm, &options) < 0 || vm_unpack_image(vm) < 0)
+        goto reply;
+
+    if (vm_job_watch_start(&watch, vm, conn) < 0)
+        goto reply;
+    const int result = vm_run_all(vm);
+    hung_up = vm_job_watch_stop(&watch);
+    if (result == 0 && !hung_up)
+        status = vm_status(vm);
+    vm_stats_report(vm);
+    vm_profile_report(vm);
+    vm_dirty_report(vm, "exit");
+
+reply:
+    if (vm)
+        vm_pool_put(&server->pool, vm, &options);
+    for (size_t i = 0; i < 2; ++i) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+
+    // nobody is left to read the reply
+    if (hung_up)
+        return status;
+
+    char reply[16];
+    int len = snprintf(reply, sizeof(reply), "%d", status);
+    if (send(conn, reply, len, MSG_NOSIGNAL) < 0)
+        perror("send job result");
+
+    return status;
+}
+
+static void *vm_server_worker(void *arg) {
+    struct vm_server *server = arg;
+
+    for (;;) {
+        int conn = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            return (void*)-1;
         }
+
+        vm_serve_job(server, conn);
+        close(conn);
     }
+}
 
-    struct kvm_regs regs = {};
-    if (ioctl(vm->cpu, KVM_GET_REGS, &regs) < 0) {
-        perror("KVM_GET_REGS");
-    } else {
-        fprintf(stderr, "RAX=%016llx RBX=%016llx RCX=%016llx RDX=%016llx\n", regs.rax, regs.rbx, regs.rcx, regs.rdx);
-        fprintf(stderr, "RSI=%016llx RDI=%016llx RSP=%016llx RBP=%016llx\n", regs.rsi, regs.rdi, regs.rsp, regs.rbp);
-        fprintf(stderr, "R8 =%016llx R9 =%016llx R10=%016llx R11=%016llx\n", regs.r8,  regs.r9,  regs.r10, regs.r11);
-        fprintf(stderr, "R12=%016llx R13=%016llx R14=%016llx R15=%016llx\n", regs.r12, regs.r13, regs.r14, regs.r15);
-        fprintf(stderr, "RIP=%016llx RFL=%016llx\n\n", regs.rip, regs.rflags);
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path is too long\n");
+        return -1;
     }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
 
-    struct kvm_sregs sregs = {};
-    if (ioctl(vm->cpu, KVM_GET_SREGS, &sregs) < 0) {
-        perror("KVM_GET_SREGS");
-    } else {
+// Server mode: keeps VMs between jobs and runs jobs from the socket on a pool of workers.
+static int run_server(const struct vm_options *options) {
+    struct vm_server server = {
+        .fd = -1,
+        .options = options
+    };
+    pthread_mutex_init(&server.pool.lock, NULL);
+    pthread_t *workers = NULL;
+    size_t worker_count = 0;
+    struct sockaddr_un addr;
 
-        vm_dump_segment("CS ", &sregs.cs);
-        vm_dump_segment("DS ", &sregs.ds);
-        vm_dump_segment("ES ", &sregs.es);
-        vm_dump_segment("FS ", &sregs.fs);
-        vm_dump_segment("GS ", &sregs.gs);
-        vm_dump_segment("SS ", &sregs.ss);
-        vm_dump_segment("TR ", &sregs.tr);
-        vm_dump_segment("LDT", &sregs.ldt);
-        fprintf(stderr, "GDT BASE=%016llx LIM=%04x        ", sregs.gdt.base, sregs.gdt.limit);
-        fprintf(stderr, "IDT BASE=%016llx LIM=%04x\n\n", sregs.idt.base, sregs.idt.limit);
+    if (socket_address(options->server_path, &addr) < 0)
+        goto fail;
 
-        fprintf(stderr, "CR0=%016llx CR2=%016llx CR3=%016llx CR4=%016llx\n", sregs.cr0, sregs.cr2, sregs.cr3, sregs.cr4);
-        fprintf(stderr, "CR8=%016llx EFER=%016llx APIC=%016llx\n", sregs.cr8, sregs.efer, sregs.apic_base);
-        fprintf(stderr, "INT BITMAP %016llx %016llx %016llx %016llx\n",
-            sregs.interrupt_bitmap[0], sregs.interrupt_bitmap[1], sregs.interrupt_bitmap[2], sregs.interrupt_bitmap[3]);
+    server.fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (server.fd < 0) {
+        perror("socket");
+        goto fail;
     }
 
-    fprintf(stderr, "===== END VM STATE =====\n\n");
-}
+    // a socket left by a previous server is in the way
+    unlink(options->server_path);
+    if (bind(server.fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        goto fail;
+    }
 
-static int vm_run(struct vm_state *vm) {
-    while (1) {
-        if (ioctl(vm->cpu, KVM_RUN, 0) < 0) {
-            perror("KVM_RUN");
-            goto fail;
-        }
+    if (listen(server.fd, SOMAXCONN) < 0) {
+        perror("listen");
+        goto fail;
+    }
 
-        if (vm->run->exit_reason == KVM_EXIT_IO && vm->run->io.port == 0x3F8 &&
-                vm->run->io.size == 1 && vm->run->io.count == 1) {
-            uint8_t* data = ((uint8_t*)vm->run) + vm->run->io.data_offset;
-            if (vm->run->io.direction == KVM_EXIT_IO_OUT) {
-                putchar(data[0]);
-            } else {
-                int c = getchar();
-                if (c == EOF)
-                    break;
-                data[0] = c;
-            }
-            continue;
-        }
+    // a client gone before the reply shouldn't kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // one VM of the default size per worker is ready before the first job
+    for (size_t i = 0; i < options->server_workers && i < VM_POOL_MAX; ++i) {
+        struct vm_state *vm = vm_pool_create(options);
+        if (!vm)
+            goto fail;
+        server.pool.vms[server.pool.count++] = vm;
+    }
 
-        vm_dump(vm);
+    workers = calloc(options->server_workers, sizeof(pthread_t));
+    if (!workers) {
+        perror("malloc");
         goto fail;
     }
 
-    return 0;
+    for (; worker_count < options->server_workers; ++worker_count) {
+        int err = pthread_create(&workers[worker_count], NULL, vm_server_worker, &server);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+
+    // workers only return when the socket fails
+    for (size_t i = 0; i < worker_count; ++i)
+        pthread_join(workers[i], NULL);
 
 fail:
+    free(workers);
+    for (size_t i = 0; i < server.pool.count; ++i)
+        vm_free(server.pool.vms[i]);
+    if (server.fd >= 0)
+        close(server.fd);
     return -1;
 }
 
+// Client side of server mode: sends the job with our stdin and stdout, returns its exit status
+// or -1 if the server couldn't be reached.
+static int submit_job(const char *image, const struct vm_options *options) {
+    struct sockaddr_un addr;
+    char path[PATH_MAX];
+    char text[VM_JOB_MAX];
+    int fd = -1;
 
-static int execute_image(const char *path, const struct vm_options *options) {
-    struct vm_state *vm = vm_create(options->mem_size);
-    if (!vm)
+    if (socket_address(options->client_path, &addr) < 0)
         goto fail;
 
-    if (vm_load_image(vm, path) < 0)
+    // the server has a working directory of its own
+    if (!realpath(image, path)) {
+        perror("realpath image");
         goto fail;
+    }
 
-    if (vm_prepare_to_boot(vm, options) < 0)
+    const char modes[] = { [VM_MODE_REAL] = 'R', [VM_MODE_PROTECTED] = 'P', [VM_MODE_LONG] = 'L' };
+    int len = snprintf(text, sizeof(text), "mode=%c mem=%zu entry=%zu ",
+        modes[options->mode], options->mem_size, options->entry_point);
+    if (options->page_table_is_set)
+        len += snprintf(text + len, sizeof(text) - len, "pt=%zu ", options->page_table);
+    len += snprintf(text + len, sizeof(text) - len, "image=%s", path);
+    if ((size_t)len >= sizeof(text)) {
+        fprintf(stderr, "Job is too long\n");
         goto fail;
+    }
 
-    if (vm_run(vm) < 0)
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
         goto fail;
+    }
 
-    vm_free(vm);
-    return 0;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        goto fail;
+    }
+
+    const int fds[2] = { STDIN_FILENO, STDOUT_FILENO };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {
+        .iov_base = text,
+        .iov_len = len
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, 0) < 0) {
+        perror("sendmsg job");
+        goto fail;
+    }
+
+    char reply[16];
+    ssize_t r = recv(fd, reply, sizeof(reply) - 1, 0);
+    if (r <= 0) {
+        fprintf(stderr, "Server closed the connection\n");
+        goto fail;
+    }
+    reply[r] = '\0';
+
+    close(fd);
+    return atoi(reply);
 
 fail:
-    vm_free(vm);
+    if (fd >= 0)
+        close(fd);
     return -1;
 }
 
-static int parse_num(const char *s, size_t *out) {
-    if (s == NULL || *s == '\0')
-        return -1;
+// One line of a batch manifest
+struct vm_batch_job {
+    struct vm_options options;
+    char *image;
+    char *input;
+    char *expect;
+    size_t status;
+    size_t line;
+};
 
-    char *end = 0;
-    errno = 0;
-    uint64_t num = strtoull(s, &end, 0);
-    if (errno != 0)
-        return -1;
+struct vm_batch {
+    struct vm_pool pool;
+    struct vm_batch_job *jobs;
+    size_t job_count;
+    size_t next_job;
+    size_t passed;
+    pthread_mutex_t report_lock;
+};
 
-    if (*end != '\0')
-        return -1;
+// Paths in a manifest are relative to its directory.
+static char *batch_path(const char *manifest, const char *path) {
+    const char *slash = strrchr(manifest, '/');
+    char *out = NULL;
+    int r = path[0] == '/' || !slash ? asprintf(&out, "%s", path) :
+        asprintf(&out, "%.*s/%s", (int)(slash - manifest), manifest, path);
+    if (r < 0) {
+        perror("malloc");
+        return NULL;
+    }
+    return out;
+}
 
-    if (num > SIZE_MAX)
+// Manifest lines are job texts like in server mode, empty lines and lines starting with # are skipped.
+static int vm_read_manifest(struct vm_batch *batch, const char *path, const struct vm_options *options) {
+    FILE *f = fopen(path, "re");
+    if (!f) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
         return -1;
+    }
 
-    *out = (size_t)num;
-    return 0;
+    char *line = NULL;
+    size_t line_size = 0, capacity = 0, number = 0;
+    ssize_t len;
+    int r = 0;
+    while (r == 0 && (len = getline(&line, &line_size, f)) >= 0) {
+        ++number;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        const char *text = line + strspn(line, " ");
+        if (!*text || *text == '#')
+            continue;
+
+        if (batch->job_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct vm_batch_job *jobs = realloc(batch->jobs, capacity * sizeof(struct vm_batch_job));
+            if (!jobs) {
+                perror("malloc");
+                r = -1;
+                break;
+            }
+            batch->jobs = jobs;
+        }
+
+        struct vm_batch_job *job = &batch->jobs[batch->job_count];
+        struct vm_job parsed = {};
+        job->options = *options;
+        job->line = number;
+        if (vm_parse_job(line, &job->options, &parsed, 1) < 0) {
+            fprintf(stderr, "%s:%zu: bad job\n", path, number);
+            r = -1;
+            break;
+        }
+
+        job->image = batch_path(path, parsed.image);
+        job->input = parsed.input ? batch_path(path, parsed.input) : NULL;
+        job->expect = parsed.expect ? batch_path(path, parsed.expect) : NULL;
+        job->status = parsed.status;
+        ++batch->job_count;
+        if (!job->image || (parsed.input && !job->input) || (parsed.expect && !job->expect))
+            r = -1;
+    }
+
+    if (r == 0 && ferror(f)) {
+        perror("read manifest");
+        r = -1;
+    }
+    free(line);
+    fclose(f);
+    return r;
+}
+
+// Compares two files from the start, returns 1 if they are equal, 0 if not, -1 on error.
+static int files_equal(int a, int b) {
+    char buf_a[16384], buf_b[16384];
+    for (off_t pos = 0; ; ) {
+        ssize_t len_a = pread(a, buf_a, sizeof(buf_a), pos);
+        ssize_t len_b = pread(b, buf_b, sizeof(buf_b), pos);
+        if (len_a < 0 || len_b < 0) {
+            perror("read output");
+            return -1;
+        }
+        if (len_a != len_b || memcmp(buf_a, buf_b, len_a) != 0)
+            return 0;
+        if (len_a == 0)
+            return 1;
+        pos += len_a;
+    }
+}
+
+// Runs one job with its input file on the serial port, the output goes to a memfd
+// to be compared with the expected one. Returns 1 if the job passed.
+static int vm_batch_run(struct vm_batch *batch, struct vm_batch_job *job) {
+    const uint64_t start = now_ns();
+    struct vm_state *vm = NULL;
+    int in_fd = -1, out_fd = -1, expect_fd = -1;
+    const char *verdict = "failed to run";
+    int status = -1;
+
+    const char *input = job->input ? job->input : "/dev/null";
+    in_fd = open(input, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) {
+        fprintf(stderr, "open %s: %s\n", input, strerror(errno));
+        goto report;
+    }
+
+    if (job->expect) {
+        expect_fd = open(job->expect, O_RDONLY | O_CLOEXEC);
+        if (expect_fd < 0) {
+            fprintf(stderr, "open %s: %s\n", job->expect, strerror(errno));
+            goto report;
+        }
+        out_fd = memfd_create("blankvm-output", MFD_CLOEXEC);
+    } else {
+        out_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    }
+    if (out_fd < 0) {
+        perror("open output");
+        goto report;
+    }
+
+    vm = vm_pool_get(&batch->pool, &job->options);
+    if (!vm)
+        goto report;
+
+    serial_attach(&vm->serial, in_fd, out_fd,
+        job->options.line_buffered ? SERIAL_FLUSH_LINE : SERIAL_FLUSH_FULL);
+
+    if (vm_load_image(vm, job->image, &job->options) < 0)
+        goto report;
+
+    if (vm_register_mem(vm, &job->options) < 0)
+        goto report;
+
+    if (vm_prepare_to_boot(vm, &job->options) < 0 || vm_unpack_image(vm) < 0)
+        goto report;
+
+    if (vm_run_all(vm) < 0)
+        goto report;
+    status = vm_status(vm);
+    vm_stats_report(vm);
+    vm_profile_report(vm);
+    vm_dirty_report(vm, "exit");
+
+    int same = job->expect ? files_equal(out_fd, expect_fd) : 1;
+    if (same < 0)
+        verdict = "failed to compare output";
+    else if (!same)
+        verdict = "output differs";
+    else if ((size_t)status != job->status)
+        verdict = "wrong exit status";
+    else
+        verdict = NULL;
+
+report:
+    if (vm && job->options.irqchip) {
+        // resets don't cover the irqchip state
+        vm_free(vm);
+    } else if (vm) {
+        vm_pool_put(&batch->pool, vm, &job->options);
+    }
+    if (in_fd >= 0)
+        close(in_fd);
+    if (out_fd >= 0)
+        close(out_fd);
+    if (expect_fd >= 0)
+        close(expect_fd);
+
+    const double ms = (now_ns() - start) / 1e6;
+    pthread_mutex_lock(&batch->report_lock);
+    if (verdict && status >= 0 && (size_t)status != job->status)
+        printf("FAIL %zu %s %.3f ms: %s (status %d)\n", job->line, job->image, ms, verdict, status);
+    else if (verdict)
+        printf("FAIL %zu %s %.3f ms: %s\n", job->line, job->image, ms, verdict);
+    else
+        printf("PASS %zu %s %.3f ms\n", job->line, job->image, ms);
+    fflush(stdout);
+    batch->passed += !verdict;
+    pthread_mutex_unlock(&batch->report_lock);
+
+    return !verdict;
+}
+
+static void *vm_batch_worker(void *arg) {
+    struct vm_batch *batch = arg;
+
+    for (;;) {
+        const size_t i = __atomic_fetch_add(&batch->next_job, 1, __ATOMIC_RELAXED);
+        if (i >= batch->job_count)
+            return NULL;
+        vm_batch_run(batch, &batch->jobs[i]);
+    }
+}
+
+// Batch mode: runs the jobs of a manifest on -j workers sharing a VM pool, like the server does.
+// Returns the number of failed jobs or -1 if the batch couldn't run.
+static int run_batch(const struct vm_options *options) {
+    struct vm_batch batch = {};
+    pthread_mutex_init(&batch.pool.lock, NULL);
+    pthread_mutex_init(&batch.report_lock, NULL);
+    pthread_t *workers = NULL;
+    size_t worker_count = 0;
+    int result = -1;
+
+    if (vm_read_manifest(&batch, options->batch_path, options) < 0)
+        goto out;
+
+    const size_t wanted = options->server_workers < batch.job_count ? options->server_workers : batch.job_count;
+    workers = calloc(wanted ? wanted : 1, sizeof(pthread_t));
+    if (!workers) {
+        perror("malloc");
+        goto out;
+    }
+
+    const uint64_t start = now_ns();
+    for (; worker_count < wanted; ++worker_count) {
+        int err = pthread_create(&workers[worker_count], NULL, vm_batch_worker, &batch);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+    if (worker_count == 0 && batch.job_count > 0)
+        goto out;
+
+    for (size_t i = 0; i < worker_count; ++i)
+        pthread_join(workers[i], NULL);
+
+    const double ms = (now_ns() - start) / 1e6;
+    printf("%zu of %zu jobs passed in %.3f ms", batch.passed, batch.job_count, ms);
+    if (batch.job_count > 0)
+        printf(", %.3f ms per job", ms / batch.job_count);
+    printf("\n");
+    result = batch.job_count - batch.passed;
+
+out:
+    free(workers);
+    for (size_t i = 0; i < batch.pool.count; ++i)
+        vm_free(batch.pool.vms[i]);
+    for (size_t i = 0; i < batch.job_count; ++i) {
+        free(batch.jobs[i].image);
+        free(batch.jobs[i].input);
+        free(batch.jobs[i].expect);
+    }
+    free(batch.jobs);
+    return result;
 }
 
 int main(int argc, char **argv) {
@@ -449,9 +6100,20 @@ int main(int argc, char **argv) {
     struct vm_options options = {
         .mode = VM_MODE_REAL,
         .mem_size = 1024 * 1024,
+        .cpu_count = 1,
+        .server_workers = 1,
+        .metrics_fd = -1,
+        .profile_fd = -1,
+        .dirty_fd = -1,
+        .input_log_fd = -1,
+        .metrics_interval_ms = 1000,
     };
+    const char *metrics_path = NULL;
+    const char *profile_path = NULL;
+    const char *dirty_path = NULL;
+    const char *input_log_path = NULL;
 
-    while ((opt = getopt(argc, argv, "RPLe:p:m:")) != -1) {
+    while ((opt = getopt(argc, argv, "RPLile:p:m:c:a:n:g:H:FzZ:uW:Cf:xd:s:M:k:w:o:q:t:Y:r:S:J:B:j:")) != -1) {
         switch (opt) {
         case 'R':
             options.mode = VM_MODE_REAL;
@@ -462,10 +6124,207 @@ int main(int argc, char **argv) {
         case 'L':
             options.mode = VM_MODE_LONG;
             break;
+        case 'l':
+            options.line_buffered = 1;
+            break;
         case 'm':
             if (parse_num(optarg, &options.mem_size) < 0)
                 goto bad_args;
             break;
+        case 'c':
+            if (parse_num(optarg, &options.cpu_count) < 0 || options.cpu_count == 0)
+                goto bad_args;
+            break;
+        case 'a':
+            if (parse_list(optarg, options.host_cpus, VM_MAX_HOST_CPUS, &options.host_cpu_count) < 0)
+                goto bad_args;
+            for (size_t i = 0; i < options.host_cpu_count; ++i) {
+                if (options.host_cpus[i] >= CPU_SETSIZE)
+                    goto bad_args;
+            }
+            break;
+        case 'n':
+            if (parse_list(optarg, options.nodes, VM_MAX_NODES, &options.node_count) < 0)
+                goto bad_args;
+            for (size_t i = 0; i < options.node_count; ++i) {
+                if (options.nodes[i] >= VM_MAX_NODES)
+                    goto bad_args;
+            }
+            break;
+        case 'H':
+            if (strcmp(optarg, "thp") == 0)
+                options.mem_backing = VM_MEM_THP;
+            else if (strcmp(optarg, "2M") == 0)
+                options.mem_backing = VM_MEM_HUGETLB_2M;
+            else if (strcmp(optarg, "1G") == 0)
+                options.mem_backing = VM_MEM_HUGETLB_1G;
+            else
+                goto bad_args;
+            break;
+        case 'F':
+            options.mem_prefault = 1;
+            break;
+        case 'z':
+            options.zero_copy = 1;
+            break;
+        case 'Z':
+            options.zero_copy = 1;
+            options.image_cache = optarg;
+            break;
+        case 'u':
+            options.lazy_mem = 1;
+            break;
+        case 'W':
+            options.packed_path = optarg;
+            break;
+        case 'C':
+            options.cpu_host = 1;
+            break;
+        case 'f': {
+            // path@addr[,ro]
+            if (options.file_count == VM_MAX_FILES)
+                goto bad_args;
+            struct vm_file *file = &options.files[options.file_count];
+            char *addr = strrchr(optarg, '@');
+            if (!addr)
+                goto bad_args;
+            *addr++ = '\0';
+            char *flags = strchr(addr, ',');
+            if (flags) {
+                *flags++ = '\0';
+                if (strcmp(flags, "ro") != 0)
+                    goto bad_args;
+                file->readonly = 1;
+            }
+            if (parse_num(addr, &file->guest_addr) < 0 || file->guest_addr % PAGE_SIZE != 0)
+                goto bad_args;
+            file->path = optarg;
+            ++options.file_count;
+            break;
+        }
+        case 'x':
+            options.snapshot = 1;
+            break;
+        case 'd':
+            if (strncmp(optarg, "bitmap:", 7) == 0)
+                options.dirty_format = VM_DIRTY_BITMAP;
+            else if (strncmp(optarg, "pages:", 6) == 0)
+                options.dirty_format = VM_DIRTY_PAGES;
+            else
+                goto bad_args;
+            dirty_path = strchr(optarg, ':') + 1;
+            break;
+        case 'r':
+            if (strncmp(optarg, "record:", 7) == 0)
+                options.input_log_replay = 0;
+            else if (strncmp(optarg, "replay:", 7) == 0)
+                options.input_log_replay = 1;
+            else
+                goto bad_args;
+            input_log_path = optarg + 7;
+            break;
+        case 's':
+            if (strcmp(optarg, "text") == 0)
+                options.stats_format = VM_STATS_TEXT;
+            else if (strcmp(optarg, "json") == 0)
+                options.stats_format = VM_STATS_JSON;
+            else
+                goto bad_args;
+            break;
+        case 'M': {
+            // path[:interval_ms]
+            char *interval = strrchr(optarg, ':');
+            if (interval) {
+                *interval++ = '\0';
+                size_t ms = 0;
+                if (parse_num(interval, &ms) < 0 || ms == 0)
+                    goto bad_args;
+                options.metrics_interval_ms = ms;
+            }
+            metrics_path = optarg;
+            break;
+        }
+        case 'k': {
+            // hz[:path]
+            char *path = strchr(optarg, ':');
+            if (path) {
+                *path++ = '\0';
+                profile_path = path;
+            }
+            if (parse_num(optarg, &options.profile_hz) < 0 || options.profile_hz == 0 ||
+                    options.profile_hz > 1000000)
+                goto bad_args;
+            break;
+        }
+        case 'i':
+            options.irqchip = 1;
+            break;
+        case 'w':
+            if (parse_num(optarg, &options.halt_poll_ns) < 0)
+                goto bad_args;
+            options.halt_poll_is_set = 1;
+            break;
+        case 'o': {
+            // addr[:size][,poll]
+            char *flags = strchr(optarg, ',');
+            if (flags) {
+                *flags++ = '\0';
+                if (strcmp(flags, "poll") != 0)
+                    goto bad_args;
+                options.output_ring_poll = 1;
+            }
+            char *size = strchr(optarg, ':');
+            options.output_ring_size = 65536;
+            if (size) {
+                *size++ = '\0';
+                if (parse_num(size, &options.output_ring_size) < 0)
+                    goto bad_args;
+            }
+            if (parse_num(optarg, &options.output_ring_addr) < 0)
+                goto bad_args;
+            // a power of two, so that free running indices wrap around with it
+            if (options.output_ring_size == 0 || options.output_ring_size > (1u << 31) ||
+                    (options.output_ring_size & (options.output_ring_size - 1)))
+                goto bad_args;
+            break;
+        }
+        case 'q': {
+            // addr[:size]
+            char *size = strchr(optarg, ':');
+            options.queue_size = 256;
+            if (size) {
+                *size++ = '\0';
+                if (parse_num(size, &options.queue_size) < 0)
+                    goto bad_args;
+            }
+            if (parse_num(optarg, &options.queue_addr) < 0)
+                goto bad_args;
+            if (options.queue_size == 0 || options.queue_size > QUEUE_MAX_SIZE ||
+                    (options.queue_size & (options.queue_size - 1)))
+                goto bad_args;
+            break;
+        }
+        case 't':
+            if (parse_num(optarg, &options.time_limit_ms) < 0 || options.time_limit_ms == 0)
+                goto bad_args;
+            break;
+        case 'Y':
+            if (parse_num(optarg, &options.cycle_budget) < 0 || options.cycle_budget == 0)
+                goto bad_args;
+            break;
+        case 'S':
+            options.server_path = optarg;
+            break;
+        case 'J':
+            options.client_path = optarg;
+            break;
+        case 'B':
+            options.batch_path = optarg;
+            break;
+        case 'j':
+            if (parse_num(optarg, &options.server_workers) < 0 || options.server_workers == 0)
+                goto bad_args;
+            break;
         case 'e':
             if (parse_num(optarg, &options.entry_point) < 0)
                 goto bad_args;
@@ -475,26 +6334,167 @@ int main(int argc, char **argv) {
                 goto bad_args;
             options.page_table_is_set = 1;
             break;
+        case 'g':
+            if (parse_num(optarg, &options.pt_page_size) < 0)
+                goto bad_args;
+            if (options.pt_page_size != 0x1000 && options.pt_page_size != 0x200000 && options.pt_page_size != 0x40000000)
+                goto bad_args;
+            break;
         default:
             goto bad_args;
         }
     }
 
+    if (options.zero_copy && (options.mem_backing == VM_MEM_HUGETLB_2M || options.mem_backing == VM_MEM_HUGETLB_1G)) {
+        fprintf(stderr, "Zero-copy image can't be mapped into hugetlb memory\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.packed_path && !options.snapshot) {
+        fprintf(stderr, "Packed image is written at the checkpoint, it needs -x\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.lazy_mem && (options.zero_copy || options.mem_prefault ||
+            options.mem_backing == VM_MEM_HUGETLB_2M || options.mem_backing == VM_MEM_HUGETLB_1G)) {
+        fprintf(stderr, "Lazy memory can't be used with a zero-copy image, prefaulting or hugetlb memory\n");
+        return EXIT_FAILURE;
+    }
+
+    if (metrics_path) {
+        options.metrics_fd = open(metrics_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (options.metrics_fd < 0) {
+            perror("open metrics");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (input_log_path) {
+        // the serial port is the only input that is logged, and only one vCPU runs in a fixed order
+        if (options.irqchip || options.queue_size || options.cpu_count != 1 || options.snapshot ||
+                options.server_path || options.client_path || options.batch_path) {
+            fprintf(stderr, "Input log works with a single vCPU and the polled serial port only, not with -x or jobs\n");
+            return EXIT_FAILURE;
+        }
+
+        options.input_log_fd = options.input_log_replay ? open(input_log_path, O_RDONLY | O_CLOEXEC) :
+            open(input_log_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (options.input_log_fd < 0) {
+            perror("open input log");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // concurrent jobs would interleave their records in the one report file
+    if (dirty_path && options.server_workers > 1 && (options.server_path || options.batch_path)) {
+        fprintf(stderr, "Dirty page report works with a single worker (-j 1) only\n");
+        return EXIT_FAILURE;
+    }
+
+    if (dirty_path) {
+        options.dirty_fd = open(dirty_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (options.dirty_fd < 0) {
+            perror("open dirty report");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (profile_path) {
+        options.profile_fd = open(profile_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (options.profile_fd < 0) {
+            perror("open profile");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // snapshots and server resets don't cover the irqchip state, a batch doesn't reuse such VMs
+    if (options.irqchip && (options.snapshot || options.server_path)) {
+        fprintf(stderr, "Interrupt-driven UART can't be used with snapshots or server mode\n");
+        return EXIT_FAILURE;
+    }
+
+    // the dirty log misses what the queue thread writes: the used ring and filled buffers
+    if (options.queue_size && options.snapshot) {
+        fprintf(stderr, "Virtqueue can't be used with snapshots\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.batch_path) {
+        if (optind != argc || options.snapshot || options.server_path || options.client_path)
+            goto bad_args;
+        const int failed = run_batch(&options);
+        return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (options.server_path) {
+        if (optind != argc || options.snapshot || options.client_path)
+            goto bad_args;
+        // only returns when it can't serve anymore
+        run_server(&options);
+        return EXIT_FAILURE;
+    }
+
     if (optind >= argc)
         goto bad_args;
 
-    if (execute_image(argv[optind], &options))
+    if (options.client_path) {
+        if (optind + 1 != argc || options.snapshot)
+            goto bad_args;
+        int status = submit_job(argv[optind], &options);
+        return status < 0 ? EXIT_FAILURE : status;
+    }
+
+    if (!options.snapshot && optind + 1 != argc)
+        goto bad_args;
+
+    if (options.snapshot && options.cpu_count != 1) {
+        fprintf(stderr, "Snapshot mode supports a single vCPU only\n");
         return EXIT_FAILURE;
+    }
 
-    return EXIT_SUCCESS;
+    int status = execute_image(argv[optind], &options, argv + optind + 1, argc - optind - 1);
+    return status < 0 ? EXIT_FAILURE : status;
 
 bad_args:
-    fprintf(stderr, "Usage: blankvm [-RPL] [-m mem_size] [-e entry] [-p page_table] image\n\n");
+    fprintf(stderr, "Usage: blankvm [-RPL] [-l] [-i] [-m mem_size] [-c cpus] [-C] [-a cpu_list] [-n node_list] [-H thp|2M|1G] [-F] [-z] [-Z dir] [-u] [-f path@addr[,ro]] [-W path] [-d bitmap|pages:path] [-r record|replay:path] [-s text|json] [-M path[:ms]] [-k hz[:path]] [-w ns] [-o addr[:size][,poll]] [-q addr[:size]] [-t ms] [-Y cycles] [-e entry] [-p page_table] [-g page_size] image\n");
+    fprintf(stderr, "       blankvm -x [options] image input...\n");
+    fprintf(stderr, "       blankvm -S socket [-j workers] [options]\n");
+    fprintf(stderr, "       blankvm -J socket [-RPL] [-m mem_size] [-e entry] [-p page_table] image\n");
+    fprintf(stderr, "       blankvm -B manifest [-j workers] [options]\n\n");
     fprintf(stderr, "  -R    real mode (16-bit)\n");
     fprintf(stderr, "  -P    protected mode (32-bit)\n");
     fprintf(stderr, "  -L    long mode (64-bit)\n");
+    fprintf(stderr, "  -l    flush serial output on every newline\n");
+    fprintf(stderr, "  -i    emulate a 16550 UART with an interrupt, using the in-kernel irqchip\n");
     fprintf(stderr, "  -m    memory size\n");
+    fprintf(stderr, "  -c    number of vCPUs\n");
+    fprintf(stderr, "  -C    pass host CPUID through and enable SSE/AVX state\n");
+    fprintf(stderr, "  -a    pin vCPUs to host CPUs, e.g. 0-3,8\n");
+    fprintf(stderr, "  -n    split memory between NUMA nodes, e.g. 0,1\n");
+    fprintf(stderr, "  -H    back memory with transparent huge pages or 2M/1G hugetlb pages\n");
+    fprintf(stderr, "  -F    prefault all memory before boot\n");
+    fprintf(stderr, "  -z    map image file copy-on-write instead of reading it\n");
+    fprintf(stderr, "  -Z    like -z, but map a copy of the image kept in a directory, e.g. /dev/shm\n");
+    fprintf(stderr, "  -u    fill guest memory from the image (snapshot with -x) on first access with userfaultfd\n");
+    fprintf(stderr, "  -f    map a host file into guest memory at addr, read-only with ro (repeatable)\n");
+    fprintf(stderr, "  -x    boot up to the checkpoint once, then run from it for every input file\n");
+    fprintf(stderr, "  -W    write memory and vCPU state at the checkpoint to a compressed image\n");
+    fprintf(stderr, "  -d    append the pages the guest wrote to a file, as a bitmap or with their contents\n");
+    fprintf(stderr, "  -r    record serial input with the exits it came at to a file, or replay it from there\n");
+    fprintf(stderr, "  -s    print exit statistics on stop and on SIGUSR1\n");
+    fprintf(stderr, "  -M    append KVM stats of the VM and vCPUs to a file every ms (default: 1000)\n");
+    fprintf(stderr, "  -k    sample guest RIP so many times per second, report on stop\n");
+    fprintf(stderr, "  -w    let KVM poll for so many ns before putting a halted vCPU to sleep\n");
+    fprintf(stderr, "  -o    write out a ring in guest memory at addr when the guest rings the doorbell, or polling it\n");
+    fprintf(stderr, "  -q    serve a virtqueue of size descriptors at addr with stdin and stdout\n");
+    fprintf(stderr, "  -t    stop the guest after so many ms of wall-clock time\n");
+    fprintf(stderr, "  -Y    stop the guest after a vCPU spent so many cycles in guest mode\n");
+    fprintf(stderr, "  -S    serve jobs on a unix socket, reusing VMs between them\n");
+    fprintf(stderr, "  -j    number of jobs the server or batch runs at once\n");
+    fprintf(stderr, "  -J    run the image as a job on the server at the socket\n");
+    fprintf(stderr, "  -B    run the jobs listed in a manifest, report pass/fail and timing\n");
     fprintf(stderr, "  -e    entry point address\n");
-    fprintf(stderr, "  -p    page table address (only for long mode)\n\n");
+    fprintf(stderr, "  -p    page table address (only for long mode)\n");
+    fprintf(stderr, "  -g    page size for generated page table: 4K, 2M or 1G (default: largest supported)\n\n");
     return EXIT_FAILURE;
 }
@@ -0,0 +1,20 @@
+bits 16
+
+    mov dx, 0E9h
+    mov si, hello
+out_loop:
+    mov al, [si]
+    test al, al
+    jz echo_loop
+    out dx, al
+    inc si
+    jmp out_loop
+
+echo_loop:
+    mov dx, 03F8h
+    in al, dx
+    out dx, al
+    jmp echo_loop
+
+hello:
+    db "Hello, world!", 10, 0
@@ -0,0 +1,31 @@
+bits 64
+
+; Prints the greeting and then in.txt, mapped read-only at 100000h with -f,
+; instead of reading it from the serial port.
+
+file equ 100000h
+
+    mov rsp, 80000h
+    mov dx, 03F8h
+    mov rsi, hello
+    call print
+    mov rsi, file
+    call print
+
+    mov dx, 0501h
+    xor eax, eax
+    out dx, al
+
+; Writes the zero-terminated string at rsi to the serial port.
+print:
+    mov al, [rsi]
+    test al, al
+    jz print_done
+    out dx, al
+    inc rsi
+    jmp print
+print_done:
+    ret
+
+hello:
+    db "Hello, world!", 10, 0
@@ -0,0 +1,44 @@
+bits 64
+
+; Echo through a polled output ring (-o 10000h:4K,poll) without ever ringing
+; the doorbell. The ring address and size come in rcx and r8 at boot.
+; Input still comes from the serial port, EOF stops the guest.
+
+    mov r9, rcx
+    lea r10, [r8 - 1]
+    mov rsp, 80000h
+    mov rsi, hello
+hello_loop:
+    mov al, [rsi]
+    test al, al
+    jz echo_loop
+    call put
+    inc rsi
+    jmp hello_loop
+
+echo_loop:
+    mov dx, 03F8h
+    in al, dx
+    call put
+    jmp echo_loop
+
+; Adds al to the ring, waiting while it's full.
+put:
+    mov ebx, [r9]
+wait_space:
+    mov ecx, ebx
+    sub ecx, [r9 + 64]
+    cmp rcx, r8
+    jb has_space
+    pause
+    jmp wait_space
+has_space:
+    mov ecx, ebx
+    and rcx, r10
+    mov [r9 + 128 + rcx], al
+    inc ebx
+    mov [r9], ebx
+    ret
+
+hello:
+    db "Hello, world!", 10, 0
@@ -0,0 +1,73 @@
+bits 64
+
+; Echo through the virtqueue (-q 10000h:16): the greeting and every chunk
+; of input go out in device-readable buffers, input comes in device-writable
+; ones. Each request is a single descriptor and its completion is polled.
+
+desc equ 10000h
+avail_idx equ 10102h
+avail_ring equ 10104h
+used_flags equ 11000h
+used_idx equ 11002h
+used_len equ 11008h
+queue_size equ 16
+buf equ 20000h
+buf_size equ 64
+
+    mov rsp, 80000h
+    xor r12d, r12d          ; next avail index
+
+    mov rdi, hello
+    mov esi, hello_len
+    xor edx, edx
+    call submit
+
+echo_loop:
+    mov rdi, buf
+    mov esi, buf_size
+    mov edx, 2              ; VRING_DESC_F_WRITE
+    call submit
+    test eax, eax
+    jz done
+    mov rdi, buf
+    mov esi, eax
+    xor edx, edx
+    call submit
+    jmp echo_loop
+
+done:
+    mov dx, 0501h
+    xor eax, eax
+    out dx, al
+
+; Queues the buffer at rdi of esi bytes with descriptor flags dx,
+; waits for it and returns the used length in eax.
+submit:
+    mov ecx, r12d
+    and ecx, queue_size - 1
+    mov ebx, ecx
+    shl ebx, 4
+    mov [desc + rbx], rdi
+    mov [desc + rbx + 8], esi
+    mov [desc + rbx + 12], dx
+    mov [avail_ring + rcx * 2], cx
+    inc r12d
+    mov [avail_idx], r12w
+    test word [used_flags], 1 ; VRING_USED_F_NO_NOTIFY
+    jnz wait_used
+    mov dx, 0503h
+    out dx, al
+wait_used:
+    cmp [used_idx], r12w
+    je completed
+    pause
+    jmp wait_used
+completed:
+    lea ecx, [r12d - 1]
+    and ecx, queue_size - 1
+    mov eax, [used_len + rcx * 8]
+    ret
+
+hello:
+    db "Hello, world!", 10
+hello_len equ $ - hello
@@ -0,0 +1,100 @@
+bits 64
+
+; Echo through the virtqueue (-q 10000h:16) like queue64, but the read for the
+; next chunk is always posted before the write of the last one, starting with
+; a read ahead of the greeting. The greeting has to come out while that read
+; waits for input. Completions are polled and matched by descriptor id.
+
+desc equ 10000h
+avail_idx equ 10102h
+avail_ring equ 10104h
+used_flags equ 11000h
+used_idx equ 11002h
+used_id equ 11004h
+used_len equ 11008h
+queue_size equ 16
+buf_size equ 64
+
+    mov rsp, 80000h
+    xor r12d, r12d          ; next avail index
+    xor r13d, r13d          ; next used index to look at
+    mov r15, 20000h         ; buffer of the pending read
+
+    mov rdi, r15
+    mov esi, buf_size
+    mov edx, 2              ; VRING_DESC_F_WRITE
+    call post
+    mov r14d, eax           ; id of the pending read
+
+    mov rdi, hello
+    mov esi, hello_len
+    xor edx, edx
+    call post
+
+echo_loop:
+    call wait_read
+    test eax, eax
+    jz done
+    mov ebp, eax
+    mov r11, r15
+    xor r15, 1000h          ; the other buffer
+    mov rdi, r15
+    mov esi, buf_size
+    mov edx, 2
+    call post
+    mov r14d, eax
+    mov rdi, r11
+    mov esi, ebp
+    xor edx, edx
+    call post
+    jmp echo_loop
+
+done:
+    cmp [used_idx], r12w
+    je exit
+    pause
+    jmp done
+exit:
+    mov dx, 0501h
+    xor eax, eax
+    out dx, al
+
+; Queues the buffer at rdi of esi bytes with descriptor flags dx
+; and returns its descriptor id in eax.
+post:
+    mov ecx, r12d
+    and ecx, queue_size - 1
+    mov ebx, ecx
+    shl ebx, 4
+    mov [desc + rbx], rdi
+    mov [desc + rbx + 8], esi
+    mov [desc + rbx + 12], dx
+    mov [avail_ring + rcx * 2], cx
+    inc r12d
+    mov [avail_idx], r12w
+    mov eax, ecx
+    test word [used_flags], 1 ; VRING_USED_F_NO_NOTIFY
+    jnz posted
+    mov dx, 0503h
+    out dx, al
+posted:
+    ret
+
+; Waits for the pending read and returns its used length in eax.
+wait_read:
+    cmp [used_idx], r13w
+    jne check_used
+    pause
+    jmp wait_read
+check_used:
+    mov ecx, r13d
+    and ecx, queue_size - 1
+    inc r13d
+    cmp [used_id + rcx * 8], r14d
+    jne wait_read
+    mov eax, [used_len + rcx * 8]
+    ret
+
+hello:
+    db "Hello, world!", 10
+hello_len equ $ - hello
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Input is only sent once the greeting is out, so the read the guest posts
+# ahead of it must not hold up the write.
+# usage: queuerx64.sh blankvm image test_dir
+
+blankvm=$1
+image=$2
+dir=$3
+out=queuerx64.out
+
+rm -f $out
+{
+    i=0
+    until grep -q Hello $out 2>/dev/null; do
+        [ $i -lt 300 ] || exit
+        sleep 0.01
+        i=$((i + 1))
+    done
+    cat "$dir/in.txt"
+} | "$blankvm" -L -q 0x10000:16 "$image" > $out || exit 1
+cmp $out "$dir/out.txt"
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Records test64 reading in.txt, then replays it without any input:
+# both runs have to print out.txt.
+# usage: record64.sh blankvm image test_dir
+
+blankvm=$1
+image=$2
+dir=$3
+
+rm -f record64.log
+"$blankvm" -L -r record:record64.log "$image" < "$dir/in.txt" > record64.out || exit 1
+cmp record64.out "$dir/out.txt" || exit 1
+"$blankvm" -L -r replay:record64.log "$image" < /dev/null > record64.out || exit 1
+cmp record64.out "$dir/out.txt"
@@ -0,0 +1,15 @@
+bits 64
+
+    mov dx, 03F8h
+    mov rsi, hello
+    mov rcx, hello_len
+    rep outsb
+
+echo_loop:
+    in al, dx
+    out dx, al
+    jmp echo_loop
+
+hello:
+    db "Hello, world!", 10
+hello_len equ $ - hello
@@ -0,0 +1,49 @@
+bits 64
+
+; Echo through the output ring (-o 10000h:4K) instead of the serial port,
+; ringing the doorbell after every byte. Input still comes from the serial
+; port, EOF stops the guest.
+
+ring_head equ 10000h
+ring_tail equ 10040h
+ring_data equ 10080h
+ring_size equ 4096
+
+    mov rsp, 80000h
+    mov rsi, hello
+hello_loop:
+    mov al, [rsi]
+    test al, al
+    jz echo_loop
+    call put
+    inc rsi
+    jmp hello_loop
+
+echo_loop:
+    mov dx, 0502h
+    out dx, al
+    mov dx, 03F8h
+    in al, dx
+    call put
+    jmp echo_loop
+
+; Adds al to the ring, waiting while it's full.
+put:
+    mov ebx, [ring_head]
+wait_space:
+    mov ecx, ebx
+    sub ecx, [ring_tail]
+    cmp ecx, ring_size
+    jb has_space
+    pause
+    jmp wait_space
+has_space:
+    mov ecx, ebx
+    and ecx, ring_size - 1
+    mov [ring_data + rcx], al
+    inc ebx
+    mov [ring_head], ebx
+    ret
+
+hello:
+    db "Hello, world!", 10, 0
@@ -0,0 +1,32 @@
+bits 64
+
+    test rdi, rdi
+    jnz secondary
+
+    ; vCPU 0 waits for the greeting and handles the echo
+wait_loop:
+    pause
+    cmp byte [done], 0
+    je wait_loop
+
+    mov dx, 03F8h
+echo_loop:
+    in al, dx
+    out dx, al
+    jmp echo_loop
+
+secondary:
+    mov dx, 03F8h
+    mov rsi, hello
+    mov rcx, hello_len
+    rep outsb
+    mov byte [done], 1
+park:
+    pause
+    jmp park
+
+done:
+    db 0
+hello:
+    db "Hello, world!", 10
+hello_len equ $ - hello
@@ -0,0 +1,39 @@
+bits 64
+
+; Snapshot mode (-x): prints a line, checkpoints on port 500h, then bumps a
+; counter in the image and one in another page and prints both before echoing
+; its input. Every run starts from the checkpoint, so both read 1 each time.
+
+total equ 100000h - 8
+
+    mov dx, 03F8h
+    mov rsi, setup
+    mov ecx, setup_len
+    rep outsb
+    mov byte [counter], '0'
+    mov qword [total], 0
+
+    mov dx, 0500h
+    out dx, al
+
+    mov dx, 03F8h
+    inc byte [counter]
+    inc qword [total]
+    mov al, [counter]
+    out dx, al
+    mov al, [total]
+    add al, '0'
+    out dx, al
+    mov al, 10
+    out dx, al
+
+echo_loop:
+    in al, dx
+    out dx, al
+    jmp echo_loop
+
+counter:
+    db 0
+setup:
+    db "Setup", 10
+setup_len equ $ - setup
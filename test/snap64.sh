@@ -0,0 +1,18 @@
+#!/bin/sh
+# Every input runs from the checkpoint: the guest's setup shows up once and
+# the counters it bumps after the checkpoint are 1 in every run.
+# usage: snap64.sh blankvm image test_dir
+
+blankvm=$1
+image=$2
+dir=$3
+
+{
+    echo Setup
+    for i in 1 2 3; do
+        echo 11
+        cat "$dir/in.txt"
+    done
+} > snap64.expect
+"$blankvm" -L -x "$image" "$dir/in.txt" "$dir/in.txt" "$dir/in.txt" > snap64.out || exit 1
+cmp snap64.out snap64.expect
@@ -0,0 +1,5 @@
+bits 64
+
+; Never stops on its own: -t has to stop it with status 124.
+
+    jmp $
@@ -0,0 +1,104 @@
+bits 64
+
+; Interrupt-driven echo through the 16550 (-i): the guest sleeps in hlt
+; and the IRQ 4 handler drains the receiver, EOF comes as DCD dropping.
+
+idt equ 10000h
+
+    mov rsp, 80000h
+    lgdt [gdt_ptr]
+    lidt [idt_ptr]
+
+    ; interrupt gate for IRQ 4 at vector 24h
+    mov rax, irq_handler
+    mov rdi, idt + 24h * 16
+    mov [rdi], ax
+    mov word [rdi + 2], 8
+    mov word [rdi + 4], 8E00h
+    shr rax, 16
+    mov [rdi + 6], ax
+    shr rax, 16
+    mov [rdi + 8], eax
+
+    ; PIC: IRQs at 20h/28h, everything but IRQ 4 masked
+    mov al, 11h
+    out 20h, al
+    out 0A0h, al
+    mov al, 20h
+    out 21h, al
+    mov al, 28h
+    out 0A1h, al
+    mov al, 4
+    out 21h, al
+    mov al, 2
+    out 0A1h, al
+    mov al, 1
+    out 21h, al
+    out 0A1h, al
+    mov al, 0EFh
+    out 21h, al
+    mov al, 0FFh
+    out 0A1h, al
+
+    mov dx, 03F8h
+    mov rsi, hello
+    mov rcx, hello_len
+    rep outsb
+
+    ; received data and modem status interrupts
+    mov dx, 03F9h
+    mov al, 09h
+    out dx, al
+
+idle:
+    cli
+    cmp byte [eof], 0
+    jne finish
+    sti
+    hlt
+    jmp idle
+
+finish:
+    mov dx, 0501h
+    xor eax, eax
+    out dx, al
+
+irq_handler:
+    push rax
+    push rdx
+drain:
+    mov dx, 03FDh
+    in al, dx
+    test al, 1
+    jz status
+    mov dx, 03F8h
+    in al, dx
+    out dx, al
+    jmp drain
+status:
+    mov dx, 03FEh
+    in al, dx
+    test al, 80h
+    jnz eoi
+    mov byte [eof], 1
+eoi:
+    mov al, 20h
+    out 20h, al
+    pop rdx
+    pop rax
+    iretq
+
+align 8
+gdt:
+    dq 0, 00209A0000000000h, 0000920000000000h
+gdt_ptr:
+    dw 23
+    dq gdt
+idt_ptr:
+    dw 256 * 16 - 1
+    dq idt
+eof:
+    db 0
+hello:
+    db "Hello, world!", 10
+hello_len equ $ - hello